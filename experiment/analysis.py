@@ -14,6 +14,8 @@ def parse(filename):
     server = args[2]
     replica = args[3]
     node = args[4]
+    # results from before the batch size was recorded ran one by one
+    batch = args[5] if len(args) > 5 else "0"
 
     with open(os.path.join(result_dir, filename)) as f:
         reader = csv.reader(f)
@@ -23,11 +25,11 @@ def parse(filename):
         if result:
             cost = str(row[0])
             time = str(float(row[1]) / 1000.)
-        return [data, algorithm, server, replica, node, cost, time]
+        return [data, algorithm, server, replica, node, batch, cost, time]
 
 
 def main():
-    header = ["data", "algorithm", "server", "replica", "node", "cost", "time"]
+    header = ["data", "algorithm", "server", "replica", "node", "batch", "cost", "time"]
     with open(os.path.join(experiment_dir, name + ".csv"), "w") as f:
         f.write(",".join(header) + "\n")
         for filename in sorted(os.listdir(result_dir)):
@@ -1,5 +1,6 @@
 import asyncio
 import os
+import sys
 import subprocess
 import functools
 
@@ -19,9 +20,19 @@ DATASETS_SMALL = ["facebook", "arxiv", "p2pgnutella", "amazonsample", "twittersa
 DATASETS_LARGE = ["amazon", "twitter"]
 
 
-async def run_program(data: str, algorithm: str, server: int, replica: int, node: int = 0):
+def convert_data(data: str):
+    # parse the edge list once, all runs of the dataset map the binary snapshot
     data_filename = os.path.join(data_root, data + ".txt")
-    base_filename = "%s-%s-%d-%d-%d" % (data, algorithm, server, replica, node)
+    snapshot_filename = os.path.join(data_root, data + ".bin")
+    if not os.path.exists(snapshot_filename) or \
+            os.path.getmtime(snapshot_filename) < os.path.getmtime(data_filename):
+        subprocess.run([program, "-d", data_filename, "-c", snapshot_filename], check=True)
+    return snapshot_filename
+
+
+async def run_program(data: str, algorithm: str, server: int, replica: int, node: int = 0, batch: int = 0):
+    data_filename = convert_data(data)
+    base_filename = "%s-%s-%d-%d-%d-%d" % (data, algorithm, server, replica, node, batch)
     output_filename = os.path.join(result_dir, base_filename)
     args = [
         program,
@@ -30,6 +41,7 @@ async def run_program(data: str, algorithm: str, server: int, replica: int, node
         "-s", str(server),
         "-k", str(replica),
         "-n", str(node),
+        "-b", str(batch),
     ]
 
     global workers, count
@@ -92,8 +104,21 @@ async def run_large():
     await asyncio.gather(*tasks)
 
 
+async def run_spar_batch():
+    # the cost of batching SPAR's edge stream, against the one by one run (batch 0)
+    tasks = []
+    for dataset in DATASETS_SMALL:
+        for batch in [0, 64, 1024, 16384]:
+            tasks.append(run_program(dataset, "spar", 128, 2, batch=batch))
+    await asyncio.gather(*tasks)
+
+
 async def main():
-    tasks = [run_large()]
+    # "python3 run.py spar-batch" runs the SPAR batch sizes instead of the large datasets
+    if len(sys.argv) > 1 and sys.argv[1] == "spar-batch":
+        tasks = [run_spar_batch()]
+    else:
+        tasks = [run_large()]
     await asyncio.gather(*tasks)
 
 
@@ -0,0 +1,421 @@
+#include "GraphFile.h"
+
+#include <algorithm>
+#include <parallel/algorithm>
+#include <limits>
+#include <fstream>
+#include <iostream>
+#include <cstring>
+#include <cctype>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <omp.h>
+
+const char GraphFile::MAGIC[8] = {'S', 'N', 'G', 'R', 'A', 'P', 'H', '\0'};
+
+static uint64_t fnv1a(const void *data, size_t size, uint64_t hash = 14695981039346656037ULL) {
+    auto bytes = (const unsigned char *) data;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+template<typename T>
+static Span<T> makeSpan(const vector<T> &data) {
+    return Span<T>{data.data(), data.size()};
+}
+
+static inline uint64_t makeArc(uint64_t nodeAId, uint64_t nodeBId) {
+    return (nodeAId << 32) | nodeBId;
+}
+
+static inline bool isBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+// the first line starting at or after pos
+static size_t findLineStart(const char *text, size_t size, size_t pos) {
+    if (pos == 0 || pos >= size) return pos;
+    auto lineEnd = (const char *) memchr(text + pos - 1, '\n', size - pos + 1);
+    return lineEnd ? lineEnd - text + 1 : size;
+}
+
+// scan the next whitespace separated field as an integer, with the same rules as TSsParser::GetInt
+static bool scanInt(const char *&p, const char *end, int &value) {
+    while (p < end && isBlank(*p)) p++;
+    bool minus = p < end && *p == '-';
+    if (minus) p++;
+    bool valid = p < end && isdigit(*p);
+    unsigned int result = 0;
+    for (; p < end && isdigit(*p); p++) {
+        result = result * 10 + (*p - '0');
+    }
+    for (; p < end && *p != '\n' && !isBlank(*p); p++) {
+        valid = false;
+    }
+    value = minus ? -(int) result : (int) result;
+    return valid;
+}
+
+// scan the optional positive weight which follows the nodes of an edge, 1 if the line ends
+static bool scanWeight(const char *&p, const char *end, int &weight) {
+    auto q = p;
+    while (q < end && isBlank(*q)) q++;
+    if (q == end || *q == '\n') {
+        weight = 1;
+        return true;
+    }
+    return scanInt(p, end, weight) && weight > 0;
+}
+
+// parse the lines in [p, end) as in TSnap::LoadEdgeList, skipping comments and malformed lines;
+// the weights of the edges are parsed too unless weights is nullptr
+static void parseEdgeLines(const char *p, const char *end, vector<GraphFile::Edge> &edges, vector<int> *weights) {
+    while (p < end) {
+        GraphFile::Edge edge{};
+        int weight;
+        if (*p != '#' && scanInt(p, end, edge.nodeAId) && scanInt(p, end, edge.nodeBId) &&
+            (!weights || scanWeight(p, end, weight))) {
+            edges.emplace_back(edge);
+            if (weights) weights->emplace_back(weight);
+        }
+        auto lineEnd = (const char *) memchr(p, '\n', end - p);
+        p = lineEnd ? lineEnd + 1 : end;
+    }
+}
+
+GraphFile::~GraphFile() {
+    unmap();
+}
+
+void GraphFile::useOwnedData() {
+    rawNodeIds = makeSpan(rawNodeIdsData);
+    loadOrder = makeSpan(loadOrderData);
+    adjacencyOffsets = makeSpan(adjacencyOffsetsData);
+    adjacency = makeSpan(adjacencyData);
+    adjacencyWeights = makeSpan(adjacencyWeightsData);
+    edges = makeSpan(edgesData);
+}
+
+void GraphFile::unmap() {
+    if (mapped) {
+        munmap(mapped, mappedSize);
+        mapped = nullptr;
+        mappedSize = 0;
+    }
+}
+
+bool GraphFile::isSnapshot(const string &fileName) {
+    ifstream fin(fileName, ios::binary);
+    char magic[sizeof(MAGIC)] = {};
+    fin.read(magic, sizeof(magic));
+    return fin && memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+void GraphFile::load(const string &fileName, size_t nodeNum, bool weighted) {
+    if (isSnapshot(fileName)) {
+        loadSnapshot(fileName);
+        // the stored weights count only with -e, as the weight column of an edge list
+        if (!weighted) {
+            adjacencyWeights = Span<int>{};
+        }
+    } else {
+        loadEdgeList(fileName, weighted);
+    }
+    truncate(nodeNum);
+}
+
+void GraphFile::loadEdgeList(const string &fileName, bool weighted) {
+    int fd = open(fileName.c_str(), O_RDONLY);
+    struct stat fileStat{};
+    if (fd < 0 || fstat(fd, &fileStat) < 0) {
+        cerr << "can not read graph file " << fileName << endl;
+        exit(-1);
+    }
+    size_t textSize = fileStat.st_size;
+    const char *text = nullptr;
+    if (textSize > 0) {
+        auto mappedText = mmap(nullptr, textSize, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (mappedText == MAP_FAILED) {
+            cerr << "can not map graph file " << fileName << endl;
+            exit(-1);
+        }
+        text = (const char *) mappedText;
+    }
+    close(fd);
+
+    // parse the file in line-aligned byte ranges, one per thread
+    int rangeNum = omp_get_max_threads();
+    vector<vector<Edge>> rangeEdges(rangeNum);
+    vector<vector<int>> rangeWeights(rangeNum);
+#pragma omp parallel for schedule(static, 1)
+    for (int i = 0; i < rangeNum; i++) {
+        auto begin = findLineStart(text, textSize, textSize * i / rangeNum);
+        auto end = findLineStart(text, textSize, textSize * (i + 1) / rangeNum);
+        parseEdgeLines(text + begin, text + end, rangeEdges[i], weighted ? &rangeWeights[i] : nullptr);
+    }
+    if (text) munmap((void *) text, textSize);
+
+    vector<size_t> rangeOffsets(rangeNum + 1, 0);
+    for (int i = 0; i < rangeNum; i++) {
+        rangeOffsets[i + 1] = rangeOffsets[i] + rangeEdges[i].size();
+    }
+    size_t fileEdgeNum = rangeOffsets.back();
+    vector<Edge> fileEdges(fileEdgeNum);
+    vector<int> fileWeights(weighted ? fileEdgeNum : 0);
+#pragma omp parallel for schedule(static, 1)
+    for (int i = 0; i < rangeNum; i++) {
+        copy(rangeEdges[i].begin(), rangeEdges[i].end(), fileEdges.begin() + rangeOffsets[i]);
+        vector<Edge>().swap(rangeEdges[i]);
+        if (weighted) {
+            copy(rangeWeights[i].begin(), rangeWeights[i].end(), fileWeights.begin() + rangeOffsets[i]);
+            vector<int>().swap(rangeWeights[i]);
+        }
+    }
+
+    // ascending dense ids keep the iteration order of the ordered containers
+    rawNodeIdsData.resize(fileEdgeNum * 2);
+#pragma omp parallel for
+    for (size_t i = 0; i < fileEdgeNum; i++) {
+        rawNodeIdsData[i * 2] = fileEdges[i].nodeAId;
+        rawNodeIdsData[i * 2 + 1] = fileEdges[i].nodeBId;
+    }
+    __gnu_parallel::sort(rawNodeIdsData.begin(), rawNodeIdsData.end());
+    rawNodeIdsData.erase(unique(rawNodeIdsData.begin(), rawNodeIdsData.end()), rawNodeIdsData.end());
+    rawNodeIdsData.shrink_to_fit();
+    auto nodeNum = rawNodeIdsData.size();
+#pragma omp parallel for
+    for (size_t i = 0; i < fileEdgeNum; i++) {
+        auto &edge = fileEdges[i];
+        edge.nodeAId = lower_bound(rawNodeIdsData.begin(), rawNodeIdsData.end(), edge.nodeAId) - rawNodeIdsData.begin();
+        edge.nodeBId = lower_bound(rawNodeIdsData.begin(), rawNodeIdsData.end(), edge.nodeBId) - rawNodeIdsData.begin();
+    }
+
+    // nodes are loaded in the order they first appear in the file
+    loadOrderData.reserve(nodeNum);
+    vector<bool> loaded(nodeNum, false);
+    for (auto &edge : fileEdges) {
+        for (auto nodeId : {edge.nodeAId, edge.nodeBId}) {
+            if (!loaded[nodeId]) {
+                loaded[nodeId] = true;
+                loadOrderData.emplace_back(nodeId);
+            }
+        }
+    }
+
+    // both directions of every edge, sorted and deduplicated, are the CSR adjacency;
+    // self loops sort to the end and are dropped
+    const uint64_t selfLoop = numeric_limits<uint64_t>::max();
+    vector<uint64_t> arcs(fileEdgeNum * 2);
+#pragma omp parallel for
+    for (size_t i = 0; i < fileEdgeNum; i++) {
+        auto &edge = fileEdges[i];
+        bool isSelfLoop = edge.nodeAId == edge.nodeBId;
+        arcs[i * 2] = isSelfLoop ? selfLoop : makeArc(edge.nodeAId, edge.nodeBId);
+        arcs[i * 2 + 1] = isSelfLoop ? selfLoop : makeArc(edge.nodeBId, edge.nodeAId);
+    }
+    if (!weighted) vector<Edge>().swap(fileEdges);
+    __gnu_parallel::sort(arcs.begin(), arcs.end());
+    arcs.erase(unique(arcs.begin(), arcs.end()), arcs.end());
+    if (!arcs.empty() && arcs.back() == selfLoop) arcs.pop_back();
+
+    adjacencyOffsetsData.resize(nodeNum + 1);
+#pragma omp parallel for
+    for (size_t nodeId = 0; nodeId <= nodeNum; nodeId++) {
+        adjacencyOffsetsData[nodeId] = lower_bound(arcs.begin(), arcs.end(), makeArc(nodeId, 0)) - arcs.begin();
+    }
+    adjacencyData.resize(arcs.size());
+#pragma omp parallel for
+    for (size_t i = 0; i < arcs.size(); i++) {
+        adjacencyData[i] = (int) (arcs[i] & 0xffffffffu);
+    }
+    vector<uint64_t>().swap(arcs);
+
+    // the weights of the file edges are added to both of their adjacency entries
+    if (weighted) {
+        adjacencyWeightsData.assign(adjacencyData.size(), 0);
+        for (size_t i = 0; i < fileEdgeNum; i++) {
+            auto &edge = fileEdges[i];
+            if (edge.nodeAId == edge.nodeBId) continue;
+            for (auto arc : {make_pair(edge.nodeAId, edge.nodeBId), make_pair(edge.nodeBId, edge.nodeAId)}) {
+                auto first = adjacencyData.begin() + adjacencyOffsetsData[arc.first];
+                auto last = adjacencyData.begin() + adjacencyOffsetsData[arc.first + 1];
+                adjacencyWeightsData[lower_bound(first, last, arc.second) - adjacencyData.begin()] += fileWeights[i];
+            }
+        }
+        vector<Edge>().swap(fileEdges);
+    }
+
+    // each edge once from its lower endpoint, visited in load order as SNAP iterates them
+    vector<size_t> edgeOffsets(nodeNum + 1, 0);
+#pragma omp parallel for
+    for (size_t i = 0; i < nodeNum; i++) {
+        auto nodeId = loadOrderData[i];
+        auto neighborEnd = adjacencyData.begin() + adjacencyOffsetsData[nodeId + 1];
+        edgeOffsets[i + 1] = neighborEnd - upper_bound(adjacencyData.begin() + adjacencyOffsetsData[nodeId], neighborEnd, nodeId);
+    }
+    for (size_t i = 0; i < nodeNum; i++) {
+        edgeOffsets[i + 1] += edgeOffsets[i];
+    }
+    edgesData.resize(edgeOffsets.back());
+#pragma omp parallel for
+    for (size_t i = 0; i < nodeNum; i++) {
+        auto nodeId = loadOrderData[i];
+        auto offset = edgeOffsets[i];
+        auto neighborEnd = adjacencyOffsetsData[nodeId + 1];
+        for (int j = neighborEnd - (edgeOffsets[i + 1] - offset); j < neighborEnd; j++) {
+            edgesData[offset++] = Edge{nodeId, adjacencyData[j]};
+        }
+    }
+
+    useOwnedData();
+}
+
+void GraphFile::loadSnapshot(const string &fileName) {
+    int fd = open(fileName.c_str(), O_RDONLY);
+    struct stat fileStat{};
+    if (fd < 0 || fstat(fd, &fileStat) < 0 || fileStat.st_size < sizeof(Header)) {
+        cerr << "can not read graph snapshot " << fileName << endl;
+        exit(-1);
+    }
+    mappedSize = fileStat.st_size;
+    mapped = mmap(nullptr, mappedSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        mapped = nullptr;
+        cerr << "can not map graph snapshot " << fileName << endl;
+        exit(-1);
+    }
+
+    auto header = (const Header *) mapped;
+    size_t nodeNum = header->nodeNum;
+    size_t payloadSize = sizeof(int) * (3 * nodeNum + 1 + header->adjacencyNum + header->weightNum) +
+                         sizeof(Edge) * header->edgeNum;
+    auto payload = (const char *) mapped + sizeof(Header);
+    if (header->version != VERSION || (header->weightNum != 0 && header->weightNum != header->adjacencyNum) ||
+        mappedSize != sizeof(Header) + payloadSize ||
+        fnv1a(payload, payloadSize) != header->checksum) {
+        cerr << "invalid graph snapshot " << fileName << endl;
+        exit(-1);
+    }
+
+    auto data = (const int *) payload;
+    rawNodeIds = Span<int>{data, nodeNum};
+    loadOrder = Span<int>{rawNodeIds.end(), nodeNum};
+    adjacencyOffsets = Span<int>{loadOrder.end(), nodeNum + 1};
+    adjacency = Span<int>{adjacencyOffsets.end(), header->adjacencyNum};
+    edges = Span<Edge>{(const Edge *) adjacency.end(), header->edgeNum};
+    adjacencyWeights = Span<int>{(const int *) edges.end(), header->weightNum};
+}
+
+void GraphFile::truncate(size_t nodeNum) {
+    auto oldNodeNum = getNodeNum();
+    if (nodeNum == 0 || nodeNum >= oldNodeNum) return;
+
+    // the kept nodes are renumbered in the same ascending order
+    vector<bool> kept(oldNodeNum, false);
+    for (size_t i = 0; i < nodeNum; i++) {
+        kept[loadOrder[i]] = true;
+    }
+    vector<int> newNodeIds(oldNodeNum, -1);
+    vector<int> newRawNodeIds, newLoadOrder, newAdjacencyOffsets, newAdjacency, newAdjacencyWeights;
+    vector<Edge> newEdges;
+    for (int nodeId = 0; nodeId < oldNodeNum; nodeId++) {
+        if (kept[nodeId]) {
+            newNodeIds[nodeId] = (int) newRawNodeIds.size();
+            newRawNodeIds.emplace_back(rawNodeIds[nodeId]);
+        }
+    }
+    for (size_t i = 0; i < nodeNum; i++) {
+        newLoadOrder.emplace_back(newNodeIds[loadOrder[i]]);
+    }
+    newAdjacencyOffsets.emplace_back(0);
+    for (int nodeId = 0; nodeId < oldNodeNum; nodeId++) {
+        if (!kept[nodeId]) continue;
+        for (int i = adjacencyOffsets[nodeId]; i < adjacencyOffsets[nodeId + 1]; i++) {
+            if (kept[adjacency[i]]) {
+                newAdjacency.emplace_back(newNodeIds[adjacency[i]]);
+                if (!adjacencyWeights.empty()) newAdjacencyWeights.emplace_back(adjacencyWeights[i]);
+            }
+        }
+        newAdjacencyOffsets.emplace_back(newAdjacency.size());
+    }
+    for (auto &edge : edges) {
+        if (kept[edge.nodeAId] && kept[edge.nodeBId]) {
+            newEdges.emplace_back(Edge{newNodeIds[edge.nodeAId], newNodeIds[edge.nodeBId]});
+        }
+    }
+
+    rawNodeIdsData.swap(newRawNodeIds);
+    loadOrderData.swap(newLoadOrder);
+    adjacencyOffsetsData.swap(newAdjacencyOffsets);
+    adjacencyData.swap(newAdjacency);
+    adjacencyWeightsData.swap(newAdjacencyWeights);
+    edgesData.swap(newEdges);
+    unmap();
+    useOwnedData();
+}
+
+void GraphFile::saveSnapshot(const string &fileName) const {
+    Header header{};
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.nodeNum = getNodeNum();
+    header.edgeNum = edges.size();
+    header.adjacencyNum = adjacency.size();
+    header.weightNum = adjacencyWeights.size();
+
+    // the sections are contiguous in the file, so the checksum runs over them in order
+    uint64_t checksum = fnv1a(rawNodeIds.begin(), sizeof(int) * rawNodeIds.size());
+    checksum = fnv1a(loadOrder.begin(), sizeof(int) * loadOrder.size(), checksum);
+    checksum = fnv1a(adjacencyOffsets.begin(), sizeof(int) * adjacencyOffsets.size(), checksum);
+    checksum = fnv1a(adjacency.begin(), sizeof(int) * adjacency.size(), checksum);
+    checksum = fnv1a(edges.begin(), sizeof(Edge) * edges.size(), checksum);
+    checksum = fnv1a(adjacencyWeights.begin(), sizeof(int) * adjacencyWeights.size(), checksum);
+    header.checksum = checksum;
+
+    ofstream fout(fileName, ios::binary);
+    fout.write((const char *) &header, sizeof(header));
+    fout.write((const char *) rawNodeIds.begin(), sizeof(int) * rawNodeIds.size());
+    fout.write((const char *) loadOrder.begin(), sizeof(int) * loadOrder.size());
+    fout.write((const char *) adjacencyOffsets.begin(), sizeof(int) * adjacencyOffsets.size());
+    fout.write((const char *) adjacency.begin(), sizeof(int) * adjacency.size());
+    fout.write((const char *) edges.begin(), sizeof(Edge) * edges.size());
+    fout.write((const char *) adjacencyWeights.begin(), sizeof(int) * adjacencyWeights.size());
+    if (!fout) {
+        cerr << "can not write graph snapshot " << fileName << endl;
+        exit(-1);
+    }
+}
+
+size_t GraphFile::getNodeNum() const {
+    return rawNodeIds.size();
+}
+
+const Span<int> &GraphFile::getRawNodeIds() const {
+    return rawNodeIds;
+}
+
+const Span<int> &GraphFile::getLoadOrder() const {
+    return loadOrder;
+}
+
+const Span<int> &GraphFile::getAdjacencyOffsets() const {
+    return adjacencyOffsets;
+}
+
+const Span<int> &GraphFile::getAdjacency() const {
+    return adjacency;
+}
+
+const Span<int> &GraphFile::getAdjacencyWeights() const {
+    return adjacencyWeights;
+}
+
+const Span<GraphFile::Edge> &GraphFile::getEdges() const {
+    return edges;
+}
@@ -0,0 +1,120 @@
+#ifndef SOCIAL_NETWORK_GRAPHFILE_H
+#define SOCIAL_NETWORK_GRAPHFILE_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+
+using namespace std;
+
+// a read-only view of an array, owned by a vector or a mapped file
+template<typename T>
+struct Span {
+    const T *first = nullptr;
+    size_t num = 0;
+
+    const T *begin() const { return first; }
+
+    const T *end() const { return first + num; }
+
+    size_t size() const { return num; }
+
+    bool empty() const { return num == 0; }
+
+    const T &operator[](size_t i) const { return first[i]; }
+
+    const T &back() const { return first[num - 1]; }
+};
+
+// The undirected social graph with dense node ids 0..N-1, assigned in ascending
+// order of the raw SNAP ids. It is either parsed from a SNAP edge list or
+// memory-mapped from a binary snapshot, which is laid out as
+//   Header | rawNodeIds[N] | loadOrder[N] | adjacencyOffsets[N + 1] | adjacency[A] | edges[E] | weights[W]
+// with all integers in host byte order. W is A for a weighted graph and 0 otherwise.
+class GraphFile {
+public:
+    struct Edge {
+        int nodeAId;
+        int nodeBId;
+    };
+
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t nodeNum;
+        uint64_t edgeNum;
+        uint64_t adjacencyNum;
+        uint64_t weightNum;
+        uint64_t checksum;    // FNV-1a of everything after the header
+    };
+
+    static const char MAGIC[8];
+    static const uint32_t VERSION = 2;
+
+private:
+    // owned arrays, unused when the graph is mapped from a snapshot
+    vector<int> rawNodeIdsData, loadOrderData, adjacencyOffsetsData, adjacencyData, adjacencyWeightsData;
+    vector<Edge> edgesData;
+
+    void *mapped = nullptr;
+    size_t mappedSize = 0;
+
+    Span<int> rawNodeIds;
+    // dense ids in the order the nodes were loaded
+    Span<int> loadOrder;
+    // CSR adjacency without self loops, neighbors sorted by id
+    Span<int> adjacencyOffsets;
+    Span<int> adjacency;
+    // the weight of each adjacency entry, empty if the graph is unweighted
+    Span<int> adjacencyWeights;
+    // each undirected edge once, in the order it was loaded
+    Span<Edge> edges;
+
+    void useOwnedData();
+
+    void unmap();
+
+    void loadEdgeList(const string &fileName, bool weighted);
+
+    void loadSnapshot(const string &fileName);
+
+    // keep only the first nodeNum nodes in load order
+    void truncate(size_t nodeNum);
+
+public:
+    GraphFile() = default;
+
+    GraphFile(const GraphFile &) = delete;
+
+    GraphFile &operator=(const GraphFile &) = delete;
+
+    ~GraphFile();
+
+    static bool isSnapshot(const string &fileName);
+
+    // load a snapshot or an edge list, and keep the first nodeNum nodes if nodeNum > 0;
+    // the third column of a weighted edge list is the interaction frequency of the
+    // edge, 1 if it is missing, and the weights of a repeated edge add up; the
+    // weights of a weighted snapshot are ignored unless weighted is set too
+    void load(const string &fileName, size_t nodeNum, bool weighted = false);
+
+    void saveSnapshot(const string &fileName) const;
+
+    size_t getNodeNum() const;
+
+    const Span<int> &getRawNodeIds() const;
+
+    const Span<int> &getLoadOrder() const;
+
+    const Span<int> &getAdjacencyOffsets() const;
+
+    const Span<int> &getAdjacency() const;
+
+    const Span<int> &getAdjacencyWeights() const;
+
+    const Span<Edge> &getEdges() const;
+};
+
+
+#endif //SOCIAL_NETWORK_GRAPHFILE_H
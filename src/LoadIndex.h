@@ -0,0 +1,258 @@
+#ifndef SOCIAL_NETWORK_LOADINDEX_H
+#define SOCIAL_NETWORK_LOADINDEX_H
+
+#include <vector>
+#include <algorithm>
+#include <cstdint>
+#include <cassert>
+
+using namespace std;
+
+// Servers bucketed by load, one set of buckets per capacity class. Within a
+// class the bucket of a load is a bitset of server ids, so a change of load
+// moves one bit between two buckets, and the least and most loaded buckets are
+// tracked as the loads change by one. Visiting merges the classes by load per
+// unit of capacity, comparing the next server of each class by cross-multiplying
+// its load and capacity in long long, so the servers are visited in exact
+// (normalized load, id) order for any integer weights. With equal capacities
+// there is a single class and no merging.
+class LoadIndex {
+private:
+    struct Class {
+        int capacity;
+        // the bucket of a load is words [load * wordNum, (load + 1) * wordNum)
+        vector<uint64_t> buckets;
+        vector<int> bucketSizes;
+        int serverNum = 0;
+        int minLoad = 0, maxLoad = 0;
+    };
+
+    // the next server of a class in a visit, serverId is -1 once it is done
+    struct Cursor {
+        int load;
+        size_t word;
+        uint64_t bits;
+        int serverId;
+    };
+
+    size_t wordNum = 0;
+    vector<int> loads;
+    vector<int> classIds;
+    vector<Class> classes;
+    mutable vector<Cursor> cursors;
+
+    int getClassId(int capacity) {
+        for (int classId = 0; classId < classes.size(); classId++) {
+            if (classes[classId].capacity == capacity) return classId;
+        }
+        classes.emplace_back();
+        classes.back().capacity = capacity;
+        classes.back().buckets.assign(wordNum, 0);
+        classes.back().bucketSizes.assign(1, 0);
+        return (int) classes.size() - 1;
+    }
+
+    void resizeWords(size_t newWordNum) {
+        for (auto &c : classes) {
+            vector<uint64_t> buckets(c.bucketSizes.size() * newWordNum, 0);
+            for (size_t load = 0; load < c.bucketSizes.size(); load++) {
+                copy(c.buckets.begin() + load * wordNum, c.buckets.begin() + (load + 1) * wordNum,
+                     buckets.begin() + load * newWordNum);
+            }
+            c.buckets.swap(buckets);
+        }
+        wordNum = newWordNum;
+    }
+
+    void insert(int serverId, int load) {
+        auto &c = classes[classIds[serverId]];
+        if (load >= c.bucketSizes.size()) {
+            c.bucketSizes.resize(load + 1, 0);
+            c.buckets.resize((load + 1) * wordNum, 0);
+        }
+        c.buckets[load * wordNum + serverId / 64] |= uint64_t(1) << (serverId % 64);
+        ++c.bucketSizes[load];
+        if (c.serverNum++ == 0) {
+            c.minLoad = c.maxLoad = load;
+        } else {
+            c.minLoad = min(c.minLoad, load);
+            c.maxLoad = max(c.maxLoad, load);
+        }
+    }
+
+    void erase(int serverId, int load) {
+        auto &c = classes[classIds[serverId]];
+        c.buckets[load * wordNum + serverId / 64] &= ~(uint64_t(1) << (serverId % 64));
+        --c.bucketSizes[load];
+        if (--c.serverNum > 0) {
+            while (c.bucketSizes[c.minLoad] == 0) ++c.minLoad;
+            while (c.bucketSizes[c.maxLoad] == 0) --c.maxLoad;
+        }
+    }
+
+    // move the cursor to the next server of the class in ascending order
+    void nextAscending(const Class &c, Cursor &cursor) const {
+        while (!cursor.bits) {
+            if (++cursor.word >= wordNum) {
+                do {
+                    ++cursor.load;
+                } while (cursor.load <= c.maxLoad && c.bucketSizes[cursor.load] == 0);
+                if (cursor.load > c.maxLoad) {
+                    cursor.serverId = -1;
+                    return;
+                }
+                cursor.word = 0;
+            }
+            cursor.bits = c.buckets[cursor.load * wordNum + cursor.word];
+        }
+        cursor.serverId = int(cursor.word * 64 + __builtin_ctzll(cursor.bits));
+        cursor.bits &= cursor.bits - 1;
+    }
+
+    // move the cursor to the next server of the class in descending order
+    void nextDescending(const Class &c, Cursor &cursor) const {
+        while (!cursor.bits) {
+            if (cursor.word-- == 0) {
+                do {
+                    --cursor.load;
+                } while (cursor.load >= c.minLoad && c.bucketSizes[cursor.load] == 0);
+                if (cursor.load < c.minLoad) {
+                    cursor.serverId = -1;
+                    return;
+                }
+                cursor.word = wordNum - 1;
+            }
+            cursor.bits = c.buckets[cursor.load * wordNum + cursor.word];
+        }
+        int bit = 63 - __builtin_clzll(cursor.bits);
+        cursor.serverId = int(cursor.word * 64 + bit);
+        cursor.bits &= ~(uint64_t(1) << bit);
+    }
+
+    // whether the next server of cursor a comes before the one of cursor b in
+    // ascending (normalized load, id) order
+    bool isBefore(const Cursor &a, const Cursor &b) const {
+        long long loadA = (long long) a.load * classes[classIds[b.serverId]].capacity;
+        long long loadB = (long long) b.load * classes[classIds[a.serverId]].capacity;
+        return loadA < loadB || (loadA == loadB && a.serverId < b.serverId);
+    }
+
+    // call visit(serverId) in the order of the cursors until it returns false,
+    // taking the first (or last if descending) of their next servers each time
+    template<typename Visit>
+    void merge(Visit &visit, bool descending) const {
+        cursors.clear();
+        for (auto &c : classes) {
+            if (c.serverNum == 0) continue;
+            Cursor cursor{descending ? c.maxLoad : c.minLoad, descending ? wordNum : size_t(-1), 0, -1};
+            descending ? nextDescending(c, cursor) : nextAscending(c, cursor);
+            cursors.emplace_back(cursor);
+        }
+        while (true) {
+            Cursor *next = nullptr;
+            for (auto &cursor : cursors) {
+                if (cursor.serverId < 0) continue;
+                if (!next || (descending ? isBefore(*next, cursor) : isBefore(cursor, *next))) {
+                    next = &cursor;
+                }
+            }
+            if (!next) return;
+            if (!visit(next->serverId)) return;
+            auto &c = classes[classIds[next->serverId]];
+            descending ? nextDescending(c, *next) : nextAscending(c, *next);
+        }
+    }
+
+public:
+    LoadIndex() = default;
+
+    explicit LoadIndex(const vector<int> &capacities)
+            : wordNum((capacities.size() + 63) / 64), loads(capacities.size(), 0) {
+        for (int serverId = 0; serverId < capacities.size(); serverId++) {
+            assert(capacities[serverId] > 0);
+            classIds.emplace_back(getClassId(capacities[serverId]));
+            insert(serverId, 0);
+        }
+    }
+
+    // a new server with load 0, its id is the number of servers so far
+    void addServer(int capacity) {
+        assert(capacity > 0);
+        int serverId = (int) loads.size();
+        loads.emplace_back(0);
+        if ((loads.size() + 63) / 64 > wordNum) {
+            resizeWords((loads.size() + 63) / 64);
+        }
+        classIds.emplace_back(getClassId(capacity));
+        insert(serverId, 0);
+    }
+
+    // an empty server is taken out of the index, its id is not reused
+    void removeServer(int serverId) {
+        assert(loads[serverId] == 0);
+        erase(serverId, 0);
+    }
+
+    // a removed server comes back empty, as after a failure is undone
+    void restoreServer(int serverId) {
+        assert(loads[serverId] == 0);
+        insert(serverId, 0);
+    }
+
+    int getLoad(int serverId) const {
+        return loads[serverId];
+    }
+
+    void setLoad(int serverId, int load) {
+        assert(load >= 0);
+        if (load == loads[serverId]) return;
+        erase(serverId, loads[serverId]);
+        insert(serverId, load);
+        loads[serverId] = load;
+    }
+
+    // call visit(serverId) in descending (normalized load, id) order until it
+    // returns false
+    template<typename Visit>
+    void visitDescending(Visit &&visit) const {
+        if (classes.size() != 1) {
+            merge(visit, true);
+            return;
+        }
+        auto &c = classes[0];
+        if (c.serverNum == 0) return;
+        for (int load = c.maxLoad; load >= c.minLoad; load--) {
+            if (c.bucketSizes[load] == 0) continue;
+            auto bucket = c.buckets.data() + load * wordNum;
+            for (size_t i = wordNum; i-- > 0;) {
+                for (auto bits = bucket[i]; bits; bits &= ~(uint64_t(1) << (63 - __builtin_clzll(bits)))) {
+                    if (!visit(int(i * 64 + 63 - __builtin_clzll(bits)))) return;
+                }
+            }
+        }
+    }
+
+    // call visit(serverId) in ascending (normalized load, id) order until it
+    // returns false
+    template<typename Visit>
+    void visit(Visit &&visit) const {
+        if (classes.size() != 1) {
+            merge(visit, false);
+            return;
+        }
+        auto &c = classes[0];
+        if (c.serverNum == 0) return;
+        for (int load = c.minLoad; load <= c.maxLoad; load++) {
+            if (c.bucketSizes[load] == 0) continue;
+            auto bucket = c.buckets.data() + load * wordNum;
+            for (size_t i = 0; i < wordNum; i++) {
+                for (auto bits = bucket[i]; bits; bits &= bits - 1) {
+                    if (!visit(int(i * 64 + __builtin_ctzll(bits)))) return;
+                }
+            }
+        }
+    }
+};
+
+
+#endif //SOCIAL_NETWORK_LOADINDEX_H
@@ -6,9 +6,16 @@
 #define SOCIAL_NETWORK_MANAGER_H
 
 #include "Server.h"
+#include "GraphFile.h"
+#include "LoadIndex.h"
+#include "MergedGraph.h"
+#include "Profiler.h"
+#include "Trace.h"
 #include <metis.h>
 #include <memory>
 #include <vector>
+#include <map>
+#include <tuple>
 #include <unordered_map>
 #include <iostream>
 #include <cassert>
@@ -16,17 +23,18 @@
 #include <random>
 #include <algorithm>
 #include <chrono>
+#include <cmath>
+#include <numeric>
+#include <fstream>
+#include <sstream>
+#include <omp.h>
 
 using namespace std;
 
 class Manager {
 public:
-    struct Node {
-        int primaryServerId = -1;
-        int virtualPrimaryNum = 0;
-
-        void Save(TSOut &SOut) const {}
-    };
+    // neighbors of a node, a view into the CSR adjacency
+    typedef Span<int> NeighborRange;
 
     enum class Algorithm {
         RANDOM,
@@ -36,336 +44,915 @@ public:
         OFFLINE
     };
 
+    // the terms are the update traffic of the copies a move adds or removes
     struct SCBValue {
-        int PDSN_B = 0;
-        int PDSN_AB = 0;
-        int PSSN = 0;
-        int DSN_AB = 0;
-        int bonus = 0;
-        int penalty = 0;
-        int value = 0;
+        long long PDSN_B = 0;
+        long long PDSN_AB = 0;
+        long long PSSN = 0;
+        long long DSN_AB = 0;
+        long long bonus = 0;
+        long long penalty = 0;
+        long long value = 0;
+    };
+
+    // For a node vj on Server A and a candidate Server B, the SCB terms are
+    // defined on the neighbors vi of vj:
+    //   PSSN:   vi is on Server A and none of vi's other neighbors is on Server B
+    //   DSN_AB: vi is neither on Server A nor on Server B and none of vi's other
+    //           neighbors is on Server B
+    //   PDSN:   vi is not on Server A, none of vi's other neighbors is on Server A
+    //           and Server A only holds a non-primary copy of vi
+    // Each vi counts the update traffic of its copy. All of them can be read from
+    // a histogram over the 2-hop neighborhood, which is built once per node
+    // instead of once per candidate server. The servers of vi's other neighbors
+    // come from the neighbor server index of vi.
+    struct SCBHistogram {
+        struct Entry {
+            long long neighborNum = 0;        // neighbors on the server
+            long long sameSideHitNum = 0;     // neighbors on Server A with another neighbor on the server
+            long long otherSideHitNum = 0;    // neighbors on other servers with another neighbor on the server
+            long long PDSN = 0;
+            bool virtualPrimary = false;
+            bool touched = false;
+        };
+
+        vector<Entry> entries;
+        vector<int> touchedServerIds;
+        long long neighborNum = 0;
+        long long sameSideNum = 0;
+        long long totalPDSN = 0;
+        // the update traffic of vj itself
+        long long traffic = 0;
+
+        explicit SCBHistogram(size_t serverNum = 0) : entries(serverNum) {}
+
+        Entry &touch(int serverId) {
+            auto &entry = entries[serverId];
+            if (!entry.touched) {
+                entry.touched = true;
+                touchedServerIds.emplace_back(serverId);
+            }
+            return entry;
+        }
+
+        void clear() {
+            for (auto serverId : touchedServerIds) {
+                entries[serverId] = Entry();
+            }
+            touchedServerIds.clear();
+            neighborNum = sameSideNum = totalPDSN = 0;
+        }
     };
 
+    // the virtual primaries SPAR adds and removes when the primary of node A moves
+    // to Server B; addToA and removeFromB can only hold node A
     struct SPARValue {
-        set<int> removeFromA;
-        set<int> removeFromB;
-        set<int> addToA;
-        set<int> addToB;
+        vector<int> removeFromA;
+        vector<int> removeFromB;
+        vector<int> addToA;
+        vector<int> addToB;
         int serverADelta = -1;
         int serverBDelta = 1;
-        int cost = 0;
+        // the update traffic of the copies added minus that of the copies removed
+        long long trafficDelta = 0;
+        long long cost = 0;
+
+        void clear() {
+            removeFromA.clear();
+            removeFromB.clear();
+            addToA.clear();
+            addToB.clear();
+        }
+    };
+
+    // reusable buffers of the SPAR evaluations of a thread, so evaluating a
+    // configuration does not allocate; a node is marked if its mark equals stamp
+    struct SPARScratch {
+        vector<int> marks;
+        int stamp = 0;
+    };
+
+    // a new edge as SPAR sees it: the primaries of the two nodes, the copies conf 1
+    // would add, and conf 2 (node to the server of the neighbor) and conf 3
+    // (neighbor to the server of node)
+    struct SPAREdge {
+        int nodeId;
+        int neighborId;
+        int nodeServerId = -1;
+        int neighborServerId = -1;
+        bool hasNeighborCopy = true;
+        bool hasNodeCopy = true;
+        SPARValue conf2;
+        SPARValue conf3;
     };
 
-    typedef TNodeNet<Node> Graph;
-    typedef Graph::TNode GraphNode;
-    typedef vector<int> MergedNode;
+    typedef MergedGraph::Group MergedNode;
 
     struct MergedNodeCompare {
         bool operator()(const MergedNode &a, const MergedNode &b) const {
-            if (a.size() != b.size()) return a.size() > b.size();
-            return a[0] < b[0];
+            if (a.nodeIds.size() != b.nodeIds.size()) return a.nodeIds.size() > b.nodeIds.size();
+            return a.nodeIds[0] < b.nodeIds[0];
         }
     };
 
 private:
     vector<unique_ptr<Server> > servers;
-    set<Server *, Server::Compare> serverSet;
-    TPt<TUNGraph> rawGraph;
-    TPt<Graph> graph;
-    vector<int> allNodes;
+    // integer capacity weights of the servers, loads are balanced per unit of capacity
+    vector<int> capacities;
+    LoadIndex loadIndex;
+
+    // nodes use dense ids 0..N-1, assigned in ascending order of the raw SNAP ids
+    GraphFile graphFile;
+    Span<int> rawNodeIds;
+    // dense ids in the order the nodes were loaded, which drives the placement
+    Span<int> allNodes;
+    // undirected edges without self loops, in the order they were loaded
+    Span<GraphFile::Edge> allEdges;
+    // CSR adjacency of the whole graph, neighbors sorted by id, and the interaction
+    // frequency of each entry (empty if the graph is unweighted)
+    Span<int> adjacencyOffsets;
+    Span<int> adjacency;
+    Span<int> adjacencyWeights;
+    // the bytes per second a copy of a node receives, its write rate times its
+    // size, which is what a non-primary copy costs in update propagation
+    vector<int> updateTraffics;
+    // the bytes of a node, which a recovery copies to a new server (1 if no
+    // attributes are loaded, so that the bytes count the copies)
+    vector<double> nodeSizes;
+    // edges added to the graph so far, stored in the same slots as adjacency
+    vector<int> neighborIds;
+    vector<int> degrees;
+
+    vector<int> primaryServerIds;
+    vector<int> virtualPrimaryNums;
+    vector<vector<Server::Replica> > replicas;
+    // for each node, the servers holding the primaries of its added neighbors and
+    // the number of such neighbors, sorted by server id; a move updates the
+    // neighbors of the moved node, so SCB scores need no 2-hop scan
+    vector<vector<pair<int, int> > > neighborServers;
+
+    // undo log of the open move transactions, and where each of them begins
+    struct MoveLogEntry {
+        enum class Type {
+            ADD_REPLICA,
+            REMOVE_REPLICA,
+            MOVE,
+        } type;
+        int nodeId;
+        // the server of the copy, or the old primary server of a moved node
+        int serverId;
+        Server::NodeType nodeType;
+        // the position of a removed copy in the replica list of the node
+        int position;
+    };
+    vector<MoveLogEntry> moveLog;
+    vector<size_t> moveLogMarks;
+    bool undoingMoves = false;
+
     size_t virtualPrimaryNum;
     int loadConstraint;
-
-    set<MergedNode, MergedNodeCompare> mergedNodes;
+    // the update traffic of all non-primary copies
+    long long interServerCost = 0;
+
+    // groups of the offline phase in MergedNodeCompare order, and the group of
+    // each node
+    vector<MergedNode> mergedNodes;
+    vector<int> groupIds;
+    // the nodes whose copies on two servers change if two groups swap
+    vector<int> swapNodes, swapDeltas;
+    vector<bool> swapMarks;
+    // SPAR scores sparBatchSize edges against the same placement and applies them
+    // in order, one by one if it is at most 1
+    size_t sparBatchSize;
+    vector<SPARScratch> sparScratches;
+    vector<SPAREdge> sparEdges;
+    vector<int> sparBatchMarks;
+    vector<int> sparNeighborMarks;
+    int sparBatchStamp = 0;
+    // working set of tryReBalance: the single nodes to move, the version of the
+    // score of each node (-1 if it is not a candidate) and the scores
+    vector<int> rebalanceCandidates;
+    vector<int> rebalanceVersions;
+    vector<int> rebalanceStamps;
+    int rebalanceStamp = 0;
+    vector<tuple<long long, int, int> > rebalanceHeap;
+    // swap partners on Server B for Server A, keyed by (B << 32 | A): a max-heap
+    // of (SCB toward A, -id) of the best swapCandidateNum primaries on B when they
+    // were last scored, and the lookups since B was last scanned
+    struct SwapCandidates {
+        vector<pair<long long, int> > heap;
+        int lookupNum = 0;
+    };
+    unordered_map<long long, SwapCandidates> swapCandidates;
+    const static int swapCandidateNum = 16;
+    // coarsening arenas, one per thread, reused by all servers
+    vector<MergedGraph> mergedGraphs;
+    // removed servers keep their ids, empty and out of the load index
+    vector<bool> removedServerMarks;
+    // the nodes which lost a copy in a failure and those copied by its recovery,
+    // and the tasks each server runs for the recovery
+    vector<int> failureNodes, recoveryNodes;
+    vector<int> recoveryTaskNums;
+    // movers of each server to moverServerId as (gain, -node id, type), and
+    // whether they have been scored since moverServerId was chosen
+    vector<vector<tuple<long long, int, int> > > moverHeaps;
+    vector<bool> moverHeapMarks;
+    int moverServerId = -1;
+    SPARValue moverSPAR;
     mt19937 randomGenerator;
     Algorithm algorithm;
 
     chrono::system_clock::time_point start;
 
+    SCBHistogram scbHistogram;
+    // diagnostics of the phases go to stderr
+    bool verbose = false;
+
+#ifdef PROFILE
+    Profiler profiler;
+#endif
+
 public:
     explicit Manager(const string &dataFile, Algorithm algorithm, size_t serverNum, size_t virtualPrimaryNum,
-                     int loadConstraint, size_t nodeNum)
-            : algorithm(algorithm), virtualPrimaryNum(virtualPrimaryNum), loadConstraint(loadConstraint) {
+                     int loadConstraint, size_t nodeNum, size_t sparBatchSize = 0,
+                     const string &capacityFile = "", bool weighted = false, const string &attributeFile = "",
+                     mt19937::result_type seed = mt19937::default_seed)
+            : algorithm(algorithm), virtualPrimaryNum(virtualPrimaryNum), loadConstraint(loadConstraint),
+              sparBatchSize(sparBatchSize), randomGenerator(seed) {
         assert(serverNum > virtualPrimaryNum);
 
-        // initialize (maybe) directed graph as undirected graph
-        graph = Graph::New();
+        loadGraph(dataFile, nodeNum, weighted);
+        if (!attributeFile.empty()) {
+            loadAttributes(attributeFile);
+        }
 
-        rawGraph = TSnap::LoadEdgeList<TPt<TUNGraph>>(dataFile.c_str(), 0, 1);
-        if (nodeNum > 0) {
-            vector<int> removeNodeIds;
-            int currentNodeNum = 0;
-            for (auto node = rawGraph->BegNI(); node != rawGraph->EndNI(); node++) {
-                if (++currentNodeNum > nodeNum) {
-                    removeNodeIds.emplace_back(node.GetId());
-                }
+        for (size_t i = 0; i < serverNum; i++) {
+            servers.emplace_back(make_unique<Server>(i, this));
+        }
+        capacities.assign(serverNum, 1);
+        if (!capacityFile.empty()) {
+            loadCapacities(capacityFile);
+        }
+        loadIndex = LoadIndex(capacities);
+        scbHistogram = SCBHistogram(serverNum);
+        removedServerMarks.assign(serverNum, false);
+    }
+
+    void loadGraph(const string &dataFile, size_t nodeNum, bool weighted) {
+        graphFile.load(dataFile, nodeNum, weighted);
+        rawNodeIds = graphFile.getRawNodeIds();
+        allNodes = graphFile.getLoadOrder();
+        allEdges = graphFile.getEdges();
+        adjacencyOffsets = graphFile.getAdjacencyOffsets();
+        adjacency = graphFile.getAdjacency();
+        adjacencyWeights = graphFile.getAdjacencyWeights();
+
+        auto loadedNodeNum = graphFile.getNodeNum();
+        updateTraffics.assign(loadedNodeNum, 1);
+        nodeSizes.assign(loadedNodeNum, 1);
+        neighborIds.resize(adjacency.size());
+        degrees.assign(loadedNodeNum, 0);
+        primaryServerIds.assign(loadedNodeNum, -1);
+        virtualPrimaryNums.assign(loadedNodeNum, 0);
+        replicas.resize(loadedNodeNum);
+        neighborServers.resize(loadedNodeNum);
+    }
+
+    // one node per line as "<raw id> <writes per second> <bytes>", # starts a
+    // comment; the update traffic of a node is rounded to whole bytes per second
+    // but is at least 1, and the nodes not listed (or not loaded) keep 1 as their
+    // traffic and size
+    void loadAttributes(const string &attributeFile) {
+        ifstream fin(attributeFile);
+        if (!fin) {
+            cerr << "can not read attribute file " << attributeFile << endl;
+            exit(-1);
+        }
+        string line;
+        for (size_t lineNum = 1; getline(fin, line); lineNum++) {
+            if (line.empty() || line[0] == '#') continue;
+            istringstream sin(line);
+            int rawNodeId;
+            double writeRate, size;
+            if (!(sin >> rawNodeId >> writeRate >> size) || writeRate < 0 || size < 0 ||
+                writeRate * size > numeric_limits<int>::max()) {
+                cerr << attributeFile << ":" << lineNum << ": malformed attributes" << endl;
+                exit(-1);
             }
-            for (auto nodeId : removeNodeIds) {
-                rawGraph->DelNode(nodeId);
+            int nodeId = getNodeId(rawNodeId);
+            if (nodeId >= 0) {
+                updateTraffics[nodeId] = max(1, (int) lround(writeRate * size));
+                nodeSizes[nodeId] = size;
             }
         }
+    }
 
-        for (auto node = rawGraph->BegNI(); node != rawGraph->EndNI(); node++) {
-            int nodeId = node.GetId();
-            graph->AddNode(nodeId);
-            allNodes.emplace_back(nodeId);
+    // one positive integer weight per line for each server in order, # starts a
+    // comment; the weights are machine sizes such as 1, 2 and 4
+    void loadCapacities(const string &capacityFile) {
+        ifstream fin(capacityFile);
+        if (!fin) {
+            cerr << "can not read capacity file " << capacityFile << endl;
+            exit(-1);
         }
-/*        for (auto node = rawGraph->BegNI(); node != rawGraph->EndNI(); node++) {
-            auto neighborNum = node.GetDeg();
-            for (int i = 0; i < neighborNum; i++) {
-                int nodeAId = node.GetId();
-                int nodeBId = node.GetNbrNId(i);
-                if (nodeAId == nodeBId) continue;
-                if (nodeAId > nodeBId) swap(nodeAId, nodeBId);
-                if (!graph->IsEdge(nodeAId, nodeBId)) {
-                    graph->AddEdge(nodeAId, nodeBId);
-                }
+        string line;
+        size_t serverId = 0;
+        while (getline(fin, line)) {
+            if (line.empty() || line[0] == '#') continue;
+            int capacity = atoi(line.c_str());
+            if (capacity <= 0 || serverId >= capacities.size()) {
+                cerr << "invalid capacity file " << capacityFile << endl;
+                exit(-1);
             }
-        }*/
+            capacities[serverId++] = capacity;
+        }
+        if (serverId != capacities.size()) {
+            cerr << "capacity file " << capacityFile << " needs " << capacities.size() << " weights" << endl;
+            exit(-1);
+        }
+    }
 
-//        graph = TSnap::LoadEdgeList<TPt<Graph>>(dataFile.c_str(), 0, 1);
+    void setVerbose(bool verbose) {
+        this->verbose = verbose;
+    }
 
-        for (size_t i = 0; i < serverNum; i++) {
-            auto server = make_unique<Server>(i, this);
-            serverSet.emplace(server.get());
-            servers.emplace_back(move(server));
+    double getNormalizedLoad(int serverId, int load) const {
+        return (double) load / capacities[serverId];
+    }
+
+    // whether the loads of two servers are within loadConstraint per unit of capacity
+    bool isLoadBalanced(int serverAId, int serverALoad, int serverBId, int serverBLoad) const {
+        return fabs(getNormalizedLoad(serverAId, serverALoad) - getNormalizedLoad(serverBId, serverBLoad)) <=
+               loadConstraint;
+    }
+
+    // called by servers whenever a primary or virtual primary is added or removed
+    void updateServerLoad(Server *server) {
+        loadIndex.setLoad(server->getId(), server->getLoad());
+    }
+
+    // called by servers whenever a non-primary replica is added or removed
+    void updateInterServerCost(long long delta) {
+        interServerCost += delta;
+    }
+
+    int getUpdateTraffic(int nodeId) const {
+        return updateTraffics[nodeId];
+    }
+
+    // the interaction frequency of an edge of the loaded graph
+    int getEdgeWeight(int nodeAId, int nodeBId) const {
+        if (adjacencyWeights.empty()) return 1;
+        auto neighbors = getAdjacency(nodeAId);
+        auto it = lower_bound(neighbors.begin(), neighbors.end(), nodeBId);
+        assert(it != neighbors.end() && *it == nodeBId);
+        return adjacencyWeights[it - adjacency.begin()];
+    }
+
+    int getRawNodeId(int nodeId) const {
+        return rawNodeIds[nodeId];
+    }
+
+    int getPrimaryServerId(int nodeId) const {
+        return primaryServerIds[nodeId];
+    }
+
+    // the copies of the node, its primary included
+    const vector<Server::Replica> &getReplicas(int nodeId) const {
+        return replicas[nodeId];
+    }
+
+    size_t getNodeNum() const {
+        return primaryServerIds.size();
+    }
+
+    size_t getServerNum() const {
+        return servers.size();
+    }
+
+    // neighbors connected by the edges added so far
+    NeighborRange getNeighbors(int nodeId) const {
+        auto first = neighborIds.data() + adjacencyOffsets[nodeId];
+        return NeighborRange{first, (size_t) degrees[nodeId]};
+    }
+
+    // all neighbors in the loaded graph
+    NeighborRange getAdjacency(int nodeId) const {
+        return NeighborRange{adjacency.begin() + adjacencyOffsets[nodeId],
+                             (size_t) (adjacencyOffsets[nodeId + 1] - adjacencyOffsets[nodeId])};
+    }
+
+    void addEdge(int nodeAId, int nodeBId) {
+        assert(degrees[nodeAId] < adjacencyOffsets[nodeAId + 1] - adjacencyOffsets[nodeAId]);
+        assert(degrees[nodeBId] < adjacencyOffsets[nodeBId + 1] - adjacencyOffsets[nodeBId]);
+        neighborIds[adjacencyOffsets[nodeAId] + degrees[nodeAId]++] = nodeBId;
+        neighborIds[adjacencyOffsets[nodeBId] + degrees[nodeBId]++] = nodeAId;
+        if (primaryServerIds[nodeBId] >= 0) {
+            updateNeighborServer(nodeAId, primaryServerIds[nodeBId], 1);
+        }
+        if (primaryServerIds[nodeAId] >= 0) {
+            updateNeighborServer(nodeBId, primaryServerIds[nodeAId], 1);
+        }
+    }
+
+    // the last neighbor of each node takes the slot of the removed one
+    void eraseEdge(int nodeAId, int nodeBId) {
+        for (auto p : {make_pair(nodeAId, nodeBId), make_pair(nodeBId, nodeAId)}) {
+            auto first = neighborIds.begin() + adjacencyOffsets[p.first];
+            auto last = first + degrees[p.first];
+            auto it = find(first, last, p.second);
+            assert(it != last);
+            *it = *(last - 1);
+            --degrees[p.first];
+        }
+        int serverAId = primaryServerIds[nodeAId];
+        int serverBId = primaryServerIds[nodeBId];
+        if (serverBId >= 0) {
+            updateNeighborServer(nodeAId, serverBId, -1);
+        }
+        if (serverAId >= 0) {
+            updateNeighborServer(nodeBId, serverAId, -1);
+        }
+    }
+
+    void updateNeighborServer(int nodeId, int serverId, int delta) {
+        auto &counts = neighborServers[nodeId];
+        auto it = lower_bound(counts.begin(), counts.end(), make_pair(serverId, numeric_limits<int>::min()));
+        if (it != counts.end() && it->first == serverId) {
+            it->second += delta;
+            if (it->second == 0) {
+                counts.erase(it);
+            }
+        } else {
+            assert(delta > 0);
+            counts.emplace(it, serverId, delta);
         }
     }
 
-    void removeServerFromSet(Server *server) {
-        serverSet.erase(server);
+    // the number of added neighbors of the node with the primary on the server
+    int getNeighborServerNum(int nodeId, int serverId) const {
+        auto &counts = neighborServers[nodeId];
+        auto it = lower_bound(counts.begin(), counts.end(), make_pair(serverId, numeric_limits<int>::min()));
+        return it != counts.end() && it->first == serverId ? it->second : 0;
     }
 
-    void addServerToSet(Server *server) {
-        serverSet.emplace(server);
+    // the weight of the edges from the node to the primaries on the server
+    int getNeighborServerWeight(int nodeId, int serverId) const {
+        if (adjacencyWeights.empty()) return getNeighborServerNum(nodeId, serverId);
+        int weight = 0;
+        for (auto neighborId : getNeighbors(nodeId)) {
+            if (primaryServerIds[neighborId] == serverId) {
+                weight += getEdgeWeight(nodeId, neighborId);
+            }
+        }
+        return weight;
     }
 
-    GraphNode &getNode(int nodeId) {
-        const Graph *g = graph();
-        const auto &node = g->GetNode(nodeId);
-        return const_cast<GraphNode &>(node);
+    // the copy of the node held by the server, nullptr if there is none
+    Server::Replica *getReplica(int nodeId, int serverId) {
+        for (auto &replica : replicas[nodeId]) {
+            if (replica.serverId == serverId) return &replica;
+        }
+        return nullptr;
+    }
+
+    bool isReplicaType(int nodeId, int serverId, Server::NodeType type) {
+        auto replica = getReplica(nodeId, serverId);
+        return replica && replica->type == type;
+    }
+
+    // called by servers whenever a copy of a node is added or removed
+    void addReplica(int nodeId, Server::Replica replica) {
+        assert(!getReplica(nodeId, replica.serverId));
+        PROFILE_COUNT(replicaAdds, 1);
+        if (!moveLogMarks.empty() && !undoingMoves) {
+            moveLog.emplace_back(MoveLogEntry{MoveLogEntry::Type::ADD_REPLICA, nodeId, replica.serverId, replica.type, 0});
+        }
+        replicas[nodeId].emplace_back(replica);
+        if (replica.type == Server::NodeType::PRIMARY) {
+            for (auto neighborId : getNeighbors(nodeId)) {
+                updateNeighborServer(neighborId, replica.serverId, 1);
+            }
+        }
+    }
+
+    void removeReplica(int nodeId, int serverId) {
+        PROFILE_COUNT(replicaRemoves, 1);
+        auto &nodeReplicas = replicas[nodeId];
+        for (size_t i = 0; i < nodeReplicas.size(); i++) {
+            auto &replica = nodeReplicas[i];
+            if (replica.serverId == serverId) {
+                if (!moveLogMarks.empty() && !undoingMoves) {
+                    moveLog.emplace_back(MoveLogEntry{MoveLogEntry::Type::REMOVE_REPLICA, nodeId, serverId,
+                                                      replica.type, (int) i});
+                }
+                if (replica.type == Server::NodeType::PRIMARY) {
+                    for (auto neighborId : getNeighbors(nodeId)) {
+                        updateNeighborServer(neighborId, serverId, -1);
+                    }
+                }
+                replica = nodeReplicas.back();
+                nodeReplicas.pop_back();
+                return;
+            }
+        }
+        assert(0);
     }
 
-    bool isEdge(int nodeAId, int nodeBId) {
-        return graph->IsEdge(nodeAId, nodeBId) || graph->IsEdge(nodeBId, nodeAId);
+    SPARValue &calculateSPAR(int nodeAId, int nodeBId, SPARValue &SPAR, SPARScratch &scratch) {
+        return calculateSPAR(nodeAId, primaryServerIds[nodeBId], nodeBId, SPAR, scratch);
     }
 
-    SPARValue calculateSPAR(int nodeAId, int nodeBId) {
-        auto &nodeA = getNode(nodeAId);
-        auto &nodeB = getNode(nodeBId);
-        int serverAId = nodeA.GetDat().primaryServerId;
-        int serverBId = nodeB.GetDat().primaryServerId;
+    // the primary of node A moves to Server B, node B (-1 if none) is the neighbor
+    // on Server B whose new edge is evaluated
+    SPARValue &calculateSPAR(int nodeAId, int serverBId, int nodeBId, SPARValue &SPAR, SPARScratch &scratch) {
+        int serverAId = primaryServerIds[nodeAId];
         auto serverA = servers[serverAId].get();
         auto serverB = servers[serverBId].get();
 
-        SPARValue SPAR;
-
-        int neighborNum = nodeA.GetDeg();
+        SPAR.clear();
+        // the nodes in addToB are marked
+        int stamp = ++scratch.stamp;
 
         // first calculate addition of virtual primary nodes
-        for (int i = 0; i < neighborNum; i++) {
-            int neighborId = nodeA.GetNbrNId(i);
+        for (auto neighborId : getNeighbors(nodeAId)) {
             if (neighborId == nodeBId) continue;
-            assert(serverA->hasNode(neighborId));
-            if (SPAR.addToA.empty() && serverA->getNode(neighborId).type == Server::NodeType::PRIMARY) {
-                SPAR.addToA.emplace(nodeAId);
+            assert(getReplica(neighborId, serverAId));
+            if (SPAR.addToA.empty() && primaryServerIds[neighborId] == serverAId) {
+                SPAR.addToA.emplace_back(nodeAId);
             }
-            if (!serverB->hasNode(neighborId)) {
-                SPAR.addToB.emplace(neighborId);
+            if (!getReplica(neighborId, serverBId)) {
+                SPAR.addToB.emplace_back(neighborId);
+                scratch.marks[neighborId] = stamp;
             }
         }
 
         // then calculate removal of virtual primary nodes
-        for (int i = 0; i < neighborNum; i++) {
-            int neighborId = nodeA.GetNbrNId(i);
+        for (auto neighborId : getNeighbors(nodeAId)) {
             if (neighborId == nodeBId) continue;
-            if (serverA->getNode(neighborId).type == Server::NodeType::VIRTUAL_PRIMARY) {
-                auto &neighborNode = getNode(neighborId);
-                int neighborNeighborNum = neighborNode.GetDeg();
-                int virtualNumAfterRemove = neighborNode.GetDat().virtualPrimaryNum - 1 +
-                                            ((int) (SPAR.addToB.find(neighborId) != SPAR.addToB.end()));
+            if (getReplica(neighborId, serverAId)->type == Server::NodeType::VIRTUAL_PRIMARY) {
+                int virtualNumAfterRemove = virtualPrimaryNums[neighborId] - 1 +
+                                            ((int) (scratch.marks[neighborId] == stamp));
                 if (virtualNumAfterRemove >= virtualPrimaryNum) {
                     bool flag = true;
-                    for (int j = 0; j < neighborNeighborNum; j++) {
-                        int neighborNeighborId = neighborNode.GetNbrNId(j);
+                    for (auto neighborNeighborId : getNeighbors(neighborId)) {
                         if (neighborNeighborId == nodeAId) continue;
-                        if (serverA->hasNode(neighborNeighborId) &&
-                            serverA->getNode(neighborNeighborId).type == Server::NodeType::PRIMARY) {
+                        if (primaryServerIds[neighborNeighborId] == serverAId) {
                             flag = false;
                             break;
                         }
                     }
                     if (flag) {
-                        SPAR.removeFromA.emplace(neighborId);
+                        SPAR.removeFromA.emplace_back(neighborId);
                     }
                 }
             }
         }
-        if (serverB->hasNode(nodeAId)) {
-            assert(serverB->getNode(nodeAId).type == Server::NodeType::VIRTUAL_PRIMARY);
-            int virtualNumAfterRemove = nodeA.GetDat().virtualPrimaryNum - 1 +
-                                        ((int) (SPAR.addToA.find(nodeAId) != SPAR.addToA.end()));
+        if (getReplica(nodeAId, serverBId)) {
+            assert(getReplica(nodeAId, serverBId)->type == Server::NodeType::VIRTUAL_PRIMARY);
+            int virtualNumAfterRemove = virtualPrimaryNums[nodeAId] - 1 + ((int) !SPAR.addToA.empty());
             if (virtualNumAfterRemove < virtualPrimaryNum) {
                 assert(SPAR.addToA.empty());
-                SPAR.addToA.emplace(nodeAId);
+                SPAR.addToA.emplace_back(nodeAId);
             }
-            SPAR.removeFromB.emplace(nodeAId);
+            SPAR.removeFromB.emplace_back(nodeAId);
         }
 
         SPAR.serverADelta = ((int) SPAR.addToA.size()) - ((int) SPAR.removeFromA.size()) - 1;
         SPAR.serverBDelta = ((int) SPAR.addToB.size()) - ((int) SPAR.removeFromB.size()) + 1;
+        SPAR.trafficDelta = sumUpdateTraffic(SPAR.addToA) + sumUpdateTraffic(SPAR.addToB) -
+                            sumUpdateTraffic(SPAR.removeFromA) - sumUpdateTraffic(SPAR.removeFromB);
+        calculateSPARCost(SPAR, serverA, serverB);
+        return SPAR;
+    }
+
+    long long sumUpdateTraffic(const vector<int> &nodeIds) const {
+        long long traffic = 0;
+        for (auto nodeId : nodeIds) {
+            traffic += updateTraffics[nodeId];
+        }
+        return traffic;
+    }
 
+    // the cost depends on the current loads, the copies to change do not
+    void calculateSPARCost(SPARValue &SPAR, Server *serverA, Server *serverB) const {
         int serverALoad = serverA->getLoad() + SPAR.serverADelta;
         int serverBLoad = serverB->getLoad() + SPAR.serverBDelta;
 
-        if (abs(serverALoad - serverBLoad) <= loadConstraint) {
-            SPAR.cost = SPAR.serverADelta + SPAR.serverBDelta;
+        if (isLoadBalanced(serverA->getId(), serverALoad, serverB->getId(), serverBLoad)) {
+            SPAR.cost = SPAR.trafficDelta;
         } else {
-            SPAR.cost = numeric_limits<int>::max() / 2;
+            SPAR.cost = numeric_limits<long long>::max() / 2;
         }
-        return SPAR;
     }
 
-    void applySPAR(const SPARValue &SPAR, int nodeAId, int nodeBId) {
-        auto &nodeA = getNode(nodeAId);
-        auto &nodeB = getNode(nodeBId);
-        int serverAId = nodeA.GetDat().primaryServerId;
-        int serverBId = nodeB.GetDat().primaryServerId;
+    // the update traffic of the copies conf 1 adds, 0 if it needs none
+    long long calculateConf1Cost(const SPAREdge &edge) const {
+        return (edge.hasNeighborCopy ? 0 : updateTraffics[edge.neighborId]) +
+               (edge.hasNodeCopy ? 0 : updateTraffics[edge.nodeId]);
+    }
+
+    void applySPAR(SPARValue &SPAR, int nodeAId, int serverBId) {
+        int serverAId = primaryServerIds[nodeAId];
         auto serverA = servers[serverAId].get();
         auto serverB = servers[serverBId].get();
 
+        // the copies are changed in ascending order of node ids
+        sort(SPAR.removeFromA.begin(), SPAR.removeFromA.end());
+        sort(SPAR.addToB.begin(), SPAR.addToB.end());
+
         serverA->removeNode(nodeAId);
         for (auto nodeId : SPAR.removeFromA) {
             serverA->removeNode(nodeId);
-            getNode(nodeId).GetDat().virtualPrimaryNum--;
+            virtualPrimaryNums[nodeId]--;
         }
         for (auto nodeId : SPAR.removeFromB) {
             serverB->removeNode(nodeId);
-            getNode(nodeId).GetDat().virtualPrimaryNum--;
+            virtualPrimaryNums[nodeId]--;
         }
         for (auto nodeId : SPAR.addToA) {
             serverA->addNode(nodeId, Server::NodeType::VIRTUAL_PRIMARY);
-            getNode(nodeId).GetDat().virtualPrimaryNum++;
+            virtualPrimaryNums[nodeId]++;
         }
         for (auto nodeId : SPAR.addToB) {
             serverB->addNode(nodeId, Server::NodeType::VIRTUAL_PRIMARY);
-            getNode(nodeId).GetDat().virtualPrimaryNum++;
+            virtualPrimaryNums[nodeId]++;
         }
         serverB->addNode(nodeAId, Server::NodeType::PRIMARY);
-        nodeA.GetDat().primaryServerId = serverBId;
+        if (!moveLogMarks.empty()) {
+            moveLog.emplace_back(MoveLogEntry{MoveLogEntry::Type::MOVE, nodeAId, serverAId, Server::NodeType::PRIMARY, 0});
+        }
+        primaryServerIds[nodeAId] = serverBId;
+
+        // the neighbors read the primary of node A when they are evaluated
+        markSPARNode(nodeAId);
+        for (auto neighborId : getNeighbors(nodeAId)) {
+            markSPARNode(neighborId);
+        }
+        for (auto nodeId : SPAR.removeFromA) {
+            markSPARNode(nodeId);
+        }
+        for (auto nodeId : SPAR.addToB) {
+            markSPARNode(nodeId);
+        }
     }
 
-    void addEdgeSPAR(int nodeId, int neighborId) {
-//        cout << "edge: " << nodeId << " " << neighborId << endl;
-        auto &node = getNode(nodeId);
-        auto &neighbor = getNode(neighborId);
+    // nodes whose copies or primary changed in the current SPAR batch
+    void markSPARNode(int nodeId) {
+        sparBatchMarks[nodeId] = sparBatchStamp;
+    }
+
+    bool isSPARNodeMarked(int nodeId) const {
+        return sparBatchMarks[nodeId] == sparBatchStamp;
+    }
+
+    // nodes which got a new edge in the current SPAR batch
+    void markSPARNeighbors(int nodeId) {
+        sparNeighborMarks[nodeId] = sparBatchStamp;
+    }
+
+    bool isSPARNeighborsMarked(int nodeId) const {
+        return sparNeighborMarks[nodeId] == sparBatchStamp;
+    }
+
+    // Whether the evaluation of a batched edge must be redone before it is applied.
+    // Conf 1 only needs the two nodes to be where they were, with the same copies
+    // on the server of each other, its cost against the moves is allowed to be
+    // stale. A move reads the copies and the edges of the two nodes and their
+    // neighbors, and the primaries of the neighbors of the neighbors (marked on the
+    // neighbors of a moved node), none of which may have changed.
+    bool isSPAREdgeStale(SPAREdge &edge) {
+        int nodeServerId = primaryServerIds[edge.nodeId];
+        int neighborServerId = primaryServerIds[edge.neighborId];
+        if (nodeServerId != edge.nodeServerId || neighborServerId != edge.neighborServerId ||
+            edge.hasNeighborCopy != (getReplica(edge.neighborId, nodeServerId) != nullptr) ||
+            edge.hasNodeCopy != (getReplica(edge.nodeId, neighborServerId) != nullptr)) {
+            return true;
+        }
+        long long conf1 = calculateConf1Cost(edge);
+        if (conf1 == 0) {
+            return false;
+        }
+        calculateSPARCost(edge.conf2, servers[nodeServerId].get(), servers[neighborServerId].get());
+        calculateSPARCost(edge.conf3, servers[neighborServerId].get(), servers[nodeServerId].get());
+        if (conf1 <= edge.conf2.cost && conf1 <= edge.conf3.cost) {
+            return false;
+        }
+        for (auto nodeId : {edge.nodeId, edge.neighborId}) {
+            if (isSPARNodeMarked(nodeId) || isSPARNeighborsMarked(nodeId)) return true;
+            for (auto neighborId : getNeighbors(nodeId)) {
+                if (isSPARNodeMarked(neighborId) || isSPARNeighborsMarked(neighborId)) return true;
+            }
+        }
+        return false;
+    }
+
+    void evaluateSPAR(SPAREdge &edge, SPARScratch &scratch) {
+        int nodeServerId = edge.nodeServerId = primaryServerIds[edge.nodeId];
+        int neighborServerId = edge.neighborServerId = primaryServerIds[edge.neighborId];
 
         // skip nodes haven't been added
-        if (node.GetDat().primaryServerId < 0 || neighbor.GetDat().primaryServerId < 0) {
+        if (nodeServerId < 0 || neighborServerId < 0) {
+            edge.hasNeighborCopy = edge.hasNodeCopy = true;
             return;
         }
 
-        auto nodeServer = servers[node.GetDat().primaryServerId].get();
-        auto neighborServer = servers[neighbor.GetDat().primaryServerId].get();
-
-        int conf1 = ((int) (!nodeServer->hasNode(neighborId))) + ((int) (!neighborServer->hasNode(nodeId)));
+        edge.hasNeighborCopy = getReplica(edge.neighborId, nodeServerId) != nullptr;
+        edge.hasNodeCopy = getReplica(edge.nodeId, neighborServerId) != nullptr;
 
         // checks whether both masters are already
         // co-located with each other or with a master’s slave.
         // If so, no further action is required.
+        if (edge.hasNeighborCopy && edge.hasNodeCopy) {
+            return;
+        }
+
+        calculateSPAR(edge.nodeId, edge.neighborId, edge.conf2, scratch);
+        calculateSPAR(edge.neighborId, edge.nodeId, edge.conf3, scratch);
+    }
+
+    void applySPAREdge(SPAREdge &edge) {
+        long long conf1 = calculateConf1Cost(edge);
         if (conf1 == 0) {
             return;
         }
 
-        SPARValue conf2 = calculateSPAR(nodeId, neighborId);
-        SPARValue conf3 = calculateSPAR(neighborId, nodeId);
+        int nodeServerId = primaryServerIds[edge.nodeId];
+        int neighborServerId = primaryServerIds[edge.neighborId];
+        auto nodeServer = servers[nodeServerId].get();
+        auto neighborServer = servers[neighborServerId].get();
+
+        // the loads may have changed since the evaluation
+        calculateSPARCost(edge.conf2, nodeServer, neighborServer);
+        calculateSPARCost(edge.conf3, neighborServer, nodeServer);
 
         // choose conf 1 if do nothing is better
-        if (conf1 <= conf2.cost && conf1 <= conf3.cost) {
-            if (!nodeServer->hasNode(neighborId)) {
-                nodeServer->addNode(neighborId, Server::NodeType::VIRTUAL_PRIMARY);
-                neighbor.GetDat().virtualPrimaryNum++;
+        if (conf1 <= edge.conf2.cost && conf1 <= edge.conf3.cost) {
+            if (!edge.hasNeighborCopy) {
+                nodeServer->addNode(edge.neighborId, Server::NodeType::VIRTUAL_PRIMARY);
+                virtualPrimaryNums[edge.neighborId]++;
+                markSPARNode(edge.neighborId);
             }
-            if (!neighborServer->hasNode(nodeId)) {
-                neighborServer->addNode(nodeId, Server::NodeType::VIRTUAL_PRIMARY);
-                node.GetDat().virtualPrimaryNum++;
+            if (!edge.hasNodeCopy) {
+                neighborServer->addNode(edge.nodeId, Server::NodeType::VIRTUAL_PRIMARY);
+                virtualPrimaryNums[edge.nodeId]++;
+                markSPARNode(edge.nodeId);
             }
             return;
         }
 
-        if (conf2.cost < conf3.cost) {
-            applySPAR(conf2, nodeId, neighborId);
+        if (edge.conf2.cost < edge.conf3.cost) {
+            applySPAR(edge.conf2, edge.nodeId, neighborServerId);
         } else {
-            applySPAR(conf3, neighborId, nodeId);
+            applySPAR(edge.conf3, edge.neighborId, nodeServerId);
         }
     }
 
+    void addEdgeSPAR(int nodeId, int neighborId) {
+//        cout << "edge: " << nodeId << " " << neighborId << endl;
+        auto &edge = sparEdges[0];
+        edge.nodeId = nodeId;
+        edge.neighborId = neighborId;
+        evaluateSPAR(edge, sparScratches[omp_get_thread_num()]);
+        applySPAREdge(edge);
+    }
+
+    // SPAR on a window of edges: all of them are evaluated in parallel against the
+    // placement before the window, then they are added and applied in order, and
+    // an edge whose decision depends on a node changed earlier in the window is
+    // evaluated again; returns the number of such edges
+    size_t addEdgesSPAR(const GraphFile::Edge *first, size_t edgeNum) {
+#pragma omp parallel for schedule(dynamic, 16)
+        for (size_t i = 0; i < edgeNum; i++) {
+            auto &edge = sparEdges[i];
+            edge.nodeId = first[i].nodeAId;
+            edge.neighborId = first[i].nodeBId;
+            evaluateSPAR(edge, sparScratches[omp_get_thread_num()]);
+        }
+
+        size_t staleNum = 0;
+        ++sparBatchStamp;
+        for (size_t i = 0; i < edgeNum; i++) {
+            auto &edge = sparEdges[i];
+            if (primaryServerIds[edge.neighborId] < 0) continue;
+            bool stale = isSPAREdgeStale(edge);
+            // the edges of a node change the moves it can make, but not conf 1
+            addEdge(edge.nodeId, edge.neighborId);
+            markSPARNeighbors(edge.nodeId);
+            markSPARNeighbors(edge.neighborId);
+            if (stale) {
+                ++staleNum;
+                evaluateSPAR(edge, sparScratches[0]);
+            }
+            applySPAREdge(edge);
+        }
+        return staleNum;
+    }
+
     pair<int, int> ensureLocality(int nodeId, int neighborId) {
-        auto &node = getNode(nodeId);
-        auto &neighbor = getNode(neighborId);
+        int nodeServerId = primaryServerIds[nodeId];
+        int neighborServerId = primaryServerIds[neighborId];
         int deltaA = 0, deltaB = 0;
 
         // skip nodes haven't been added
-        if (node.GetDat().primaryServerId < 0 || neighbor.GetDat().primaryServerId < 0) {
+        if (nodeServerId < 0 || neighborServerId < 0) {
             return make_pair(deltaA, deltaB);
         }
 
-        auto nodeServer = servers[node.GetDat().primaryServerId].get();
-        auto neighborServer = servers[neighbor.GetDat().primaryServerId].get();
-
-        if (!nodeServer->hasNode(neighborId)) {
-            nodeServer->addNode(neighborId, Server::NodeType::NON_PRIMARY);
+        if (!getReplica(neighborId, nodeServerId)) {
+            servers[nodeServerId]->addNode(neighborId, Server::NodeType::NON_PRIMARY);
             ++deltaA;
         }
-        if (!neighborServer->hasNode(nodeId)) {
-            neighborServer->addNode(nodeId, Server::NodeType::NON_PRIMARY);
+        if (!getReplica(nodeId, neighborServerId)) {
+            servers[neighborServerId]->addNode(nodeId, Server::NodeType::NON_PRIMARY);
             ++deltaB;
         }
         return make_pair(deltaA, deltaB);
     }
 
     pair<int, int> shrinkLocality(int nodeId, int neighborId) {
-        auto &node = getNode(nodeId);
-        auto &neighbor = getNode(neighborId);
+        int nodeServerId = primaryServerIds[nodeId];
 
         // skip nodes haven't been added
-        if (node.GetDat().primaryServerId < 0 || neighbor.GetDat().primaryServerId < 0) {
+        if (nodeServerId < 0 || primaryServerIds[neighborId] < 0) {
             return make_pair(0, 0);
         }
 
-        auto nodeServer = servers[node.GetDat().primaryServerId].get();
-
         // we can only delete non primary node
-        assert(nodeServer->hasNode(neighborId));
-        if (nodeServer->getNode(neighborId).type != Server::NodeType::NON_PRIMARY) {
+        assert(getReplica(neighborId, nodeServerId));
+        if (getReplica(neighborId, nodeServerId)->type != Server::NodeType::NON_PRIMARY) {
             return make_pair(0, 0);
         }
 
         // if any of neighbor's neighbor except self has a primary copy in the server, we can not delete
-        auto neighborNeighborNum = neighbor.GetDeg();
-        for (int i = 0; i < neighborNeighborNum; i++) {
-            auto neighborNeighborId = neighbor.GetNbrNId(i);
+        for (auto neighborNeighborId : getNeighbors(neighborId)) {
             if (neighborNeighborId == nodeId) continue;
-            if (nodeServer->hasNode(neighborNeighborId) &&
-                nodeServer->getNode(neighborNeighborId).type == Server::NodeType::PRIMARY) {
+            if (primaryServerIds[neighborNeighborId] == nodeServerId) {
                 return make_pair(0, 0);
             }
         }
 
-        nodeServer->removeNode(neighborId);
+        servers[nodeServerId]->removeNode(neighborId);
         return make_pair(-1, 0);
     }
 
-    void addNode(int nodeId) {
-        auto &node = getNode(nodeId);
+    // Drops the copy of the node on the server if no neighbor on the server needs
+    // it any more, the same reasoning as shrinkLocality, but read from the
+    // neighbor servers of the node instead of a scan of its neighbors. A virtual
+    // primary is only dropped while the node has more than k of them, which SPAR
+    // can leave when it adds virtual primaries for locality.
+    void collectReplica(int nodeId, int serverId) {
+        auto replica = getReplica(nodeId, serverId);
+        if (!replica || replica->type == Server::NodeType::PRIMARY ||
+            getNeighborServerNum(nodeId, serverId) > 0) {
+            return;
+        }
+        if (replica->type == Server::NodeType::NON_PRIMARY) {
+            servers[serverId]->removeNode(nodeId);
+        } else if (virtualPrimaryNums[nodeId] > virtualPrimaryNum) {
+            servers[serverId]->removeNode(nodeId);
+            virtualPrimaryNums[nodeId]--;
+        }
+    }
 
-        auto it = serverSet.begin();
-        auto primaryServer = *it;
-        node.GetDat().primaryServerId = primaryServer->getId();
-        vector<int> virtualPrimaryServerIds;
-        for (++it; virtualPrimaryServerIds.size() < virtualPrimaryNum; ++it) {
-            virtualPrimaryServerIds.emplace_back((*it)->getId());
+    // removes an added edge, and the copies of the two nodes which were only kept
+    // for each other
+    void removeEdge(int nodeAId, int nodeBId) {
+        eraseEdge(nodeAId, nodeBId);
+        int serverAId = primaryServerIds[nodeAId];
+        int serverBId = primaryServerIds[nodeBId];
+        if (serverAId >= 0 && serverBId >= 0) {
+            collectReplica(nodeBId, serverAId);
+            collectReplica(nodeAId, serverBId);
+        }
+    }
+
+    // removes an added node with its edges and all its copies
+    void removeNode(int nodeId) {
+        while (degrees[nodeId] > 0) {
+            removeEdge(nodeId, neighborIds[adjacencyOffsets[nodeId] + degrees[nodeId] - 1]);
+        }
+        while (!replicas[nodeId].empty()) {
+            servers[replicas[nodeId].back().serverId]->removeNode(nodeId);
         }
+        primaryServerIds[nodeId] = -1;
+        virtualPrimaryNums[nodeId] = 0;
+    }
+
+    void addNode(int nodeId) {
+        // the k + 1 least loaded servers hold the primary and the virtual primaries
+        int primaryServerId = -1;
+        vector<int> virtualPrimaryServerIds;
+        loadIndex.visit([&](int serverId) {
+            if (primaryServerId < 0) {
+                primaryServerId = serverId;
+            } else {
+                virtualPrimaryServerIds.emplace_back(serverId);
+            }
+            return virtualPrimaryServerIds.size() < virtualPrimaryNum;
+        });
+        auto primaryServer = servers[primaryServerId].get();
+        primaryServerIds[nodeId] = primaryServerId;
 #ifndef NDEBUG
         //        cout << "--- add node " << nodeId << " (" << primaryServer->getId() <<  ") ---" << endl;
 #endif
@@ -374,12 +961,61 @@ public:
             auto virtualPrimaryServer = servers[virtualPrimaryServerId].get();
             virtualPrimaryServer->addNode(nodeId, Server::NodeType::VIRTUAL_PRIMARY);
         }
-        node.GetDat().virtualPrimaryNum = virtualPrimaryNum;
+        virtualPrimaryNums[nodeId] = virtualPrimaryNum;
+    }
+
+    // Moves made between beginMoves and commitMoves form a transaction, their
+    // cost is read from the servers, which count their non-primary copies as
+    // they change. abortMoves restores the placement from the undo log of the
+    // copies added and removed since beginMoves instead of moving the nodes
+    // back. Transactions can be nested.
+    void beginMoves() {
+        moveLogMarks.emplace_back(moveLog.size());
+    }
+
+    void commitMoves() {
+        moveLogMarks.pop_back();
+        if (moveLogMarks.empty()) {
+            moveLog.clear();
+        }
+    }
+
+    // restoring marks an abort which puts the placement back after a simulated
+    // failure rather than rejecting the moves, for the profiler
+    void abortMoves(bool restoring = false) {
+        auto mark = moveLogMarks.back();
+        moveLogMarks.pop_back();
+        undoingMoves = true;
+        while (moveLog.size() > mark) {
+            auto entry = moveLog.back();
+            moveLog.pop_back();
+            switch (entry.type) {
+                case MoveLogEntry::Type::ADD_REPLICA:
+                    servers[entry.serverId]->removeNode(entry.nodeId);
+                    break;
+                case MoveLogEntry::Type::REMOVE_REPLICA: {
+                    // the copy is added to the back, put it back to its old position
+                    servers[entry.serverId]->addNode(entry.nodeId, entry.nodeType);
+                    auto &nodeReplicas = replicas[entry.nodeId];
+                    swap(nodeReplicas[entry.position], nodeReplicas.back());
+                    break;
+                }
+                case MoveLogEntry::Type::MOVE:
+                    if (restoring) {
+                        PROFILE_COUNT(movesRestored, 1);
+                    } else {
+                        PROFILE_COUNT(movesReverted, 1);
+                    }
+                    primaryServerIds[entry.nodeId] = entry.serverId;
+                    break;
+            }
+        }
+        undoingMoves = false;
     }
 
     pair<int, int> moveNode(int nodeId, int serverBId) {
-        auto &node = getNode(nodeId);
-        int serverAId = node.GetDat().primaryServerId;
+        PROFILE_COUNT(moves, 1);
+        int serverAId = primaryServerIds[nodeId];
 #ifndef NDEBUG
         //        cout << "--- move node " << nodeId << " (" << serverAId << " -> " << serverBId << ") ---" << endl;
 #endif
@@ -389,14 +1025,12 @@ public:
         int deltaA = 0, deltaB = 0;
 
         // clear unused locality on Server A
-        auto neighborNum = node.GetDeg();
-        for (int i = 0; i < neighborNum; i++) {
-            auto neighborId = node.GetNbrNId(i);
+        for (auto neighborId : getNeighbors(nodeId)) {
             auto p = shrinkLocality(nodeId, neighborId);
             deltaA += p.first;
         }
 
-        if (serverB->hasNode(nodeId) && serverB->getNode(nodeId).type == Server::NodeType::VIRTUAL_PRIMARY) {
+        if (isReplicaType(nodeId, serverBId, Server::NodeType::VIRTUAL_PRIMARY)) {
             // When a node moves from Server A to Server B, if the
             // Server B holds the virtual primary copy of the node, the primary
             // copy of the node from Server A will be swapped with
@@ -410,8 +1044,8 @@ public:
             --deltaB;
         } else {
             serverA->removeNode(nodeId);
-            if (serverB->hasNode(nodeId)) {
-                assert(serverB->getNode(nodeId).type == Server::NodeType::NON_PRIMARY);
+            if (auto replicaB = getReplica(nodeId, serverBId)) {
+                assert(replicaB->type == Server::NodeType::NON_PRIMARY);
                 serverB->removeNode(nodeId);
                 --deltaB;
             }
@@ -420,9 +1054,11 @@ public:
         }
 
         // rebuild locality on Server B
-        node.GetDat().primaryServerId = serverBId;
-        for (int i = 0; i < neighborNum; i++) {
-            auto neighborId = node.GetNbrNId(i);
+        if (!moveLogMarks.empty()) {
+            moveLog.emplace_back(MoveLogEntry{MoveLogEntry::Type::MOVE, nodeId, serverAId, Server::NodeType::PRIMARY, 0});
+        }
+        primaryServerIds[nodeId] = serverBId;
+        for (auto neighborId : getNeighbors(nodeId)) {
             auto p = ensureLocality(nodeId, neighborId);
             deltaA += p.second;
             deltaB += p.first;
@@ -430,166 +1066,176 @@ public:
         return make_pair(deltaA, deltaB);
     }
 
-    // is vi Same Side Neighbor of vj
-    static bool isSSN(GraphNode &vj, GraphNode &vi) {
-        return vj.GetDat().primaryServerId == vi.GetDat().primaryServerId;
-    }
+    void buildSCBHistogram(int nodeId, SCBHistogram &histogram) {
+        int serverAId = primaryServerIds[nodeId];
 
-    // is vi Pure Same Side Neighbor of vj (no neighbor on Server B)
-    bool isPSSN(GraphNode &vj, GraphNode &vi, int serverBId) {
-        if (!isSSN(vj, vi)) return false;
-        auto neighborNum = vi.GetDeg();
-        for (int i = 0; i < neighborNum; i++) {
-            auto neighborId = vi.GetNbrNId(i);
-            if (neighborId == vj.GetId()) continue;
-            auto &neighbor = getNode(neighborId);
-            if (neighbor.GetDat().primaryServerId < 0) continue;
-            if (neighbor.GetDat().primaryServerId == serverBId) return false;
-        }
-        return true;
-    }
+        histogram.clear();
+        histogram.traffic = updateTraffics[nodeId];
+        for (auto neighborId : getNeighbors(nodeId)) {
+            int neighborServerId = primaryServerIds[neighborId];
+            if (neighborServerId < 0) continue;
 
-    // is vi Different Side Neighbor of vj
-    static bool isDSN(GraphNode &vj, GraphNode &vi) {
-        return vj.GetDat().primaryServerId != vi.GetDat().primaryServerId;
-    }
+            int traffic = updateTraffics[neighborId];
+            histogram.neighborNum += traffic;
+            histogram.touch(neighborServerId).neighborNum += traffic;
+            if (neighborServerId == serverAId) {
+                histogram.sameSideNum += traffic;
+            }
+
+            // the distinct servers of the neighbor's other neighbors, the node
+            // itself is one of its neighbors on Server A
+            bool hitServerA = false;
+            for (auto &p : neighborServers[neighborId]) {
+                int serverId = p.first;
+                if (serverId == serverAId) {
+                    hitServerA = p.second > 1;
+                } else if (serverId != neighborServerId) {
+                    if (neighborServerId == serverAId) {
+                        histogram.touch(serverId).sameSideHitNum += traffic;
+                    } else {
+                        histogram.touch(serverId).otherSideHitNum += traffic;
+                    }
+                }
+            }
 
-    bool isDSN(GraphNode &vj, GraphNode &vi, int serverBId) {
-        if (!isDSN(vj, vi)) return false;
-        auto neighborNum = vi.GetDeg();
-        for (int i = 0; i < neighborNum; i++) {
-            auto neighborId = vi.GetNbrNId(i);
-            if (neighborId == vj.GetId()) continue;
-            auto &neighbor = getNode(neighborId);
-            if (neighbor.GetDat().primaryServerId < 0) continue;
-            if (neighbor.GetDat().primaryServerId == serverBId) return false;
+            if (neighborServerId != serverAId && !hitServerA &&
+                isReplicaType(neighborId, serverAId, Server::NodeType::NON_PRIMARY)) {
+                histogram.touch(neighborServerId).PDSN += traffic;
+                histogram.totalPDSN += traffic;
+            }
         }
-        return true;
-    }
 
-    // is vi Pure Different Side Neighbor of vj
-    bool isPDSN(GraphNode &vj, GraphNode &vi) {
-        if (!isDSN(vj, vi)) return false;
-        auto neighborNum = vi.GetDeg();
-        for (int i = 0; i < neighborNum; i++) {
-            auto neighborId = vi.GetNbrNId(i);
-            if (neighborId == vj.GetId()) continue;
-            auto &neighbor = getNode(neighborId);
-            if (neighbor.GetDat().primaryServerId < 0) continue;
-            if (neighbor.GetDat().primaryServerId == vj.GetDat().primaryServerId) return false;
+        // if serverB has virtual primary nodeA, they will be swapped
+        for (auto &replica : replicas[nodeId]) {
+            if (replica.type == Server::NodeType::VIRTUAL_PRIMARY) {
+                histogram.touch(replica.serverId).virtualPrimary = true;
+            }
         }
-        return true;
     }
 
-    SCBValue calculateSCB(int nodeId, int serverBId, vector<int> &PDSNs, int totalPDSN) {
-        auto &node = getNode(nodeId);
-        auto neighborNum = node.GetDeg();
-        int serverAId = node.GetDat().primaryServerId;
-        assert(serverAId != serverBId);
-        auto serverA = servers[serverAId].get();
-        auto serverB = servers[serverBId].get();
-
+    static SCBValue calculateSCB(const SCBHistogram &histogram, int serverBId) {
+        const auto &entry = histogram.entries[serverBId];
         SCBValue SCB;
-
-        SCB.PDSN_B += PDSNs[serverBId];
-        SCB.PDSN_AB += totalPDSN - PDSNs[serverAId] - PDSNs[serverBId];
+        SCB.PDSN_B = entry.PDSN;
+        SCB.PDSN_AB = histogram.totalPDSN - entry.PDSN;
+        SCB.PSSN = histogram.sameSideNum - entry.sameSideHitNum;
+        SCB.DSN_AB = histogram.neighborNum - histogram.sameSideNum - entry.neighborNum - entry.otherSideHitNum;
 
         // if serverB has virtual primary nodeA, they will be swapped
         // so serverA has one more virtual primary node (penalty = -1)
         // and serverB has one less virtual primary node (bonus = 1)
-        if (serverB->hasNode(nodeId) && serverB->getNode(nodeId).type == Server::NodeType::VIRTUAL_PRIMARY) {
-            SCB.penalty = -1;
-            SCB.bonus = 1;
+        if (entry.virtualPrimary) {
+            SCB.penalty = -histogram.traffic;
+            SCB.bonus = histogram.traffic;
+        } else {
+            SCB.bonus = entry.neighborNum > 0 ? histogram.traffic : 0;
+            SCB.penalty = histogram.sameSideNum > 0 ? -histogram.traffic : 0;
         }
 
-        for (int i = 0; i < neighborNum; i++) {
-            auto neighborId = node.GetNbrNId(i);
-            assert(graph->IsEdge(nodeId, neighborId) || graph->IsEdge(neighborId, nodeId));
-            auto &neighbor = getNode(neighborId);
-            int neighborServerId = neighbor.GetDat().primaryServerId;
+        SCB.value = SCB.PDSN_B + SCB.PDSN_AB - SCB.PSSN - SCB.DSN_AB + SCB.bonus + SCB.penalty;
+        return SCB;
+    }
 
-            if (neighborServerId >= 0) {
-                /*if (!PDSNs && neighborServerId == serverBId &&
-                    serverA->getNode(neighborId).type == Server::NodeType::NON_PRIMARY) {
-                    SCB.PDSN_B += (int) isPDSN(node, neighbor);
+    pair<SCBValue, int> findMaxSCB(int nodeId, int targetServer = -1) {
+        PROFILE_COUNT(findMaxSCBCalls, 1);
+        return findMaxSCB(nodeId, targetServer, scbHistogram);
+    }
+
+    // SCB of a single candidate server, read from the neighbor server index without
+    // building the histogram
+    SCBValue calculateSCB(int nodeId, int serverBId) {
+        int serverAId = primaryServerIds[nodeId];
+        assert(serverAId != serverBId);
+
+        SCBValue SCB;
+        bool hasSameSideNeighbor = false, hasServerBNeighbor = false;
+        for (auto neighborId : getNeighbors(nodeId)) {
+            int neighborServerId = primaryServerIds[neighborId];
+            if (neighborServerId < 0) continue;
+            if (neighborServerId == serverBId) {
+                hasServerBNeighbor = true;
+            } else if (neighborServerId == serverAId) {
+                hasSameSideNeighbor = true;
+            }
+
+            bool isPDSNCandidate = neighborServerId != serverAId &&
+                                   isReplicaType(neighborId, serverAId, Server::NodeType::NON_PRIMARY);
+            // the node itself is one of the neighbor's neighbors on Server A,
+            // and a neighbor on Server B only contributes to PDSN_B
+            bool hitServerA = isPDSNCandidate && getNeighborServerNum(neighborId, serverAId) > 1;
+            bool hitServerB = neighborServerId != serverBId && getNeighborServerNum(neighborId, serverBId) > 0;
+
+            int traffic = updateTraffics[neighborId];
+            if (isPDSNCandidate && !hitServerA) {
+                if (neighborServerId == serverBId) {
+                    SCB.PDSN_B += traffic;
+                } else {
+                    SCB.PDSN_AB += traffic;
                 }
-                if (!PDSNs && neighborServerId != serverAId && neighborServerId != serverBId &&
-                    serverA->getNode(neighborId).type == Server::NodeType::NON_PRIMARY) {
-                    SCB.PDSN_AB += (int) isPDSN(node, neighbor);
-                }*/
+            }
+            if (!hitServerB) {
                 if (neighborServerId == serverAId) {
-                    SCB.PSSN += (int) isPSSN(node, neighbor, serverBId);
-                }
-                if (neighborServerId != serverAId && neighborServerId != serverBId) {
-                    SCB.DSN_AB += (int) isDSN(node, neighbor, serverBId);
-                }
-                if (SCB.bonus == 0 && neighborServerId == serverBId) {
-                    SCB.bonus = 1;
-                }
-                if (SCB.penalty == 0 && neighborServerId == serverAId) {
-                    SCB.penalty = -1;
+                    SCB.PSSN += traffic;
+                } else if (neighborServerId != serverBId) {
+                    SCB.DSN_AB += traffic;
                 }
             }
         }
 
+        // if serverB has virtual primary nodeA, they will be swapped
+        // so serverA has one more virtual primary node (penalty = -1)
+        // and serverB has one less virtual primary node (bonus = 1)
+        int traffic = updateTraffics[nodeId];
+        if (isReplicaType(nodeId, serverBId, Server::NodeType::VIRTUAL_PRIMARY)) {
+            SCB.penalty = -traffic;
+            SCB.bonus = traffic;
+        } else {
+            SCB.bonus = hasServerBNeighbor ? traffic : 0;
+            SCB.penalty = hasSameSideNeighbor ? -traffic : 0;
+        }
+
         SCB.value = SCB.PDSN_B + SCB.PDSN_AB - SCB.PSSN - SCB.DSN_AB + SCB.bonus + SCB.penalty;
         return SCB;
     }
 
-    pair<SCBValue, int> findMaxSCB(int nodeId, int targetServer = -1) {
-        auto &node = getNode(nodeId);
-        auto neighborNum = node.GetDeg();
-        int serverAId = node.GetDat().primaryServerId;
-        assert(targetServer != serverAId);
-        auto serverA = servers[serverAId].get();
+    pair<SCBValue, int> findMaxSCB(int nodeId, int targetServer, SCBHistogram &histogram) {
+        int serverAId = primaryServerIds[nodeId];
 
-        vector<int> PDSNs(servers.size());
-        int totalPDSN = 0;
-//        int SSN = 0;
-//        int PSSN = 0;
-//        SNValue total;
-
-        for (int i = 0; i < neighborNum; i++) {
-            auto neighborId = node.GetNbrNId(i);
-//            assert(graph->IsEdge(nodeId, neighborId) || graph->IsEdge(neighborId, nodeId));
-            auto &neighbor = getNode(neighborId);
-            int serverBId = neighbor.GetDat().primaryServerId;
-            if (serverBId >= 0) {
-                if (serverA->getNode(neighborId).type == Server::NodeType::NON_PRIMARY && isPDSN(node, neighbor)) {
-                    PDSNs[serverBId] += 1;
-                    totalPDSN += 1;
-                }
-//                int DSN = (int) isDSN(node, neighbor);
-//                int PDSN = (int) isPDSN(node, neighbor);
-//                values[serverBId].DSN += DSN;
-//                values[serverBId].PDSN += PDSN;
-//                SSN += (int) isSSN(node, neighbor);
-//                PSSN += (int) isPSSN(node, neighbor);
-//                total.DSN += DSN;
-//                total.PDSN += PDSN;
+        if (targetServer >= 0) {
+            // a target equal to Server A (stale single nodes in tryReBalance) is
+            // redirected to the next server, as the per-server scan always did
+            if (targetServer == serverAId && ++targetServer == servers.size()) {
+                SCBValue SCB;
+                SCB.value = numeric_limits<long long>::min();
+                return make_pair(SCB, serverAId);
             }
+            return make_pair(calculateSCB(nodeId, targetServer), targetServer);
         }
 
-        int maxSCBServerId = serverAId;
+        buildSCBHistogram(nodeId, histogram);
+
+        // servers hosting none of the 2-hop neighbors all share the same score,
+        // so only the first of them needs to be compared with the candidates
+        int maxSCBServerId = 0;
+        while (maxSCBServerId < servers.size() &&
+               (maxSCBServerId == serverAId || histogram.entries[maxSCBServerId].touched ||
+                removedServerMarks[maxSCBServerId])) {
+            ++maxSCBServerId;
+        }
         SCBValue maxSCB;
-        maxSCB.value = numeric_limits<int>::min();
-        int serverBId = targetServer >= 0 ? targetServer : 0;
-        for (; serverBId < servers.size(); serverBId++) {
+        if (maxSCBServerId < servers.size()) {
+            maxSCB = calculateSCB(histogram, maxSCBServerId);
+        } else {
+            maxSCBServerId = serverAId;
+            maxSCB.value = numeric_limits<long long>::min();
+        }
+        for (auto serverBId : histogram.touchedServerIds) {
             if (serverBId == serverAId) continue;
-            SCBValue SCB = calculateSCB(nodeId, serverBId, PDSNs, totalPDSN);
-/*//            int SCB = 0;
-            SCB.PDSN_B = values[serverBId].PDSN;
-            SCB.PDSN_AB = total.PDSN - values[serverAId].PDSN - values[serverBId].PDSN;
-            SCB.DSN_AB = total.DSN - values[serverAId].DSN - values[serverBId].DSN;
-            SCB.PSSN = PSSN;
-            SCB.bonus = (int) (values[serverBId].DSN > 0);
-            SCB.penalty = -(int) (SSN > 0);
-            SCB.value = SCB.PDSN_B + SCB.PDSN_AB - SCB.PSSN - SCB.DSN_AB + SCB.bonus + SCB.penalty;*/
-            if (SCB.value > maxSCB.value) {
+            SCBValue SCB = calculateSCB(histogram, serverBId);
+            if (SCB.value > maxSCB.value || (SCB.value == maxSCB.value && serverBId < maxSCBServerId)) {
                 maxSCB = SCB;
                 maxSCBServerId = serverBId;
             }
-            if (targetServer >= 0) break;
         }
 
         assert(maxSCBServerId != serverAId);
@@ -597,29 +1243,29 @@ public:
     }
 
     void _reallocateNode(int nodeId, SCBValue SCB, int serverBId) {
-        auto &node = getNode(nodeId);
-        int serverAId = node.GetDat().primaryServerId;
+        int serverAId = primaryServerIds[nodeId];
         assert(serverAId != serverBId);
 #ifndef NDEBUG
         //        cout << "--- reallocate node " << nodeId << " (" << serverAId << " -> " << serverBId << ") ---" << endl;
 #endif
         auto serverA = servers[serverAId].get();
         auto serverB = servers[serverBId].get();
-        assert(serverA->getNode(nodeId).type == Server::NodeType::PRIMARY);
+        assert(isReplicaType(nodeId, serverAId, Server::NodeType::PRIMARY));
 
         auto serverALoad = serverA->getLoad();
         auto serverBLoad = serverB->getLoad();
-        if (!serverB->hasNode(nodeId) || serverB->getNode(nodeId).type == Server::NodeType::NON_PRIMARY) {
+        if (!isReplicaType(nodeId, serverBId, Server::NodeType::VIRTUAL_PRIMARY)) {
             --serverALoad;
             ++serverBLoad;
         }
 
 //        int cost1 = computeInterServerCost();
 
-        if (abs(serverALoad - serverBLoad) <= loadConstraint) {
+        if (isLoadBalanced(serverAId, serverALoad, serverBId, serverBLoad)) {
             // The node is moved to Server B if it would not violate the
             // load balance constraint.
             auto p1 = moveNode(nodeId, serverBId);
+            touchSwapCandidates(nodeId, serverAId);
 
 /*            int cost2 = computeInterServerCost();
             cout << "move " << cost1 - cost2 << " " << SCB.value << endl;
@@ -629,28 +1275,29 @@ public:
         } else {
             // Otherwise, the algorithm tries to swap the node vi with
             // another node on Server B.
+            beginMoves();
             auto p1 = moveNode(nodeId, serverBId);
 
-            int maxSCBNodeId = -1;
-            SCBValue maxSCB;
-            maxSCB.value = numeric_limits<int>::min();
-            for (auto serverBNodeId : serverB->getPrimaryNodes()) {
-                auto p = findMaxSCB(serverBNodeId, serverAId);
-                SCBValue tempSCB = p.first;
-                if (tempSCB.value > maxSCB.value) {
-                    maxSCB = tempSCB;
-                    maxSCBNodeId = serverBNodeId;
-                }
+            long long maxSCBValue;
+            int maxSCBNodeId = findSwapCandidate(serverBId, serverAId, maxSCBValue);
+            // the node itself is on Server B now, but not among its candidates yet
+            long long value = findMaxSCB(nodeId, serverAId).first.value;
+            if (maxSCBNodeId < 0 || value > maxSCBValue || (value == maxSCBValue && nodeId < maxSCBNodeId)) {
+                maxSCBValue = value;
+                maxSCBNodeId = nodeId;
             }
             // If the sum of the SCBs of the two
             // nodes, i.e., vi (to be moved from A to B) and vj (to be moved
             // from B to A) is positive, they are swapped.
             auto p2 = p1;
-            if (maxSCBNodeId >= 0 && SCB.value + maxSCB.value > 0) {
-                assert(serverB->getNode(maxSCBNodeId).type == Server::NodeType::PRIMARY);
+            if (maxSCBNodeId >= 0 && SCB.value + maxSCBValue > 0) {
+                assert(isReplicaType(maxSCBNodeId, serverBId, Server::NodeType::PRIMARY));
                 p2 = moveNode(maxSCBNodeId, serverAId);
+                commitMoves();
+                touchSwapCandidates(nodeId, serverAId);
+                touchSwapCandidates(maxSCBNodeId, serverBId);
             } else {
-                p2 = moveNode(nodeId, serverAId);
+                abortMoves();
             }
 /*            int cost2 = computeInterServerCost();
             if (maxSCBNodeId >= 0 && SCB.value + maxSCB.value > 0) {
@@ -672,25 +1319,91 @@ public:
 
     }
 
+    // A primary moved off oldServerId can now be swapped toward every other server,
+    // and it changes the SCB of its neighbors toward both servers, so these are put
+    // on the candidates of those pairs unscored, to be scored when they are taken.
+    void touchSwapCandidates(int nodeId, int oldServerId) {
+        if (swapCandidates.empty()) return;
+        for (int targetServerId = 0; targetServerId < servers.size(); targetServerId++) {
+            auto it = swapCandidates.find((long long) primaryServerIds[nodeId] << 32 | targetServerId);
+            if (it == swapCandidates.end() || it->second.heap.empty()) continue;
+            it->second.heap.emplace_back(numeric_limits<long long>::max(), -nodeId);
+            push_heap(it->second.heap.begin(), it->second.heap.end());
+        }
+        for (auto neighborId : getNeighbors(nodeId)) {
+            int serverId = primaryServerIds[neighborId];
+            if (serverId < 0) continue;
+            for (auto targetServerId : {oldServerId, primaryServerIds[nodeId]}) {
+                if (targetServerId == serverId) continue;
+                auto it = swapCandidates.find((long long) serverId << 32 | targetServerId);
+                if (it == swapCandidates.end() || it->second.heap.empty()) continue;
+                it->second.heap.emplace_back(numeric_limits<long long>::max(), -neighborId);
+                push_heap(it->second.heap.begin(), it->second.heap.end());
+            }
+        }
+    }
+
+    // The primary on Server B with the largest SCB toward Server A (the smallest id
+    // among ties) and its SCB, -1 if Server B has none. The candidates of the pair
+    // come from a scan of all primaries on Server B, which is repeated when they
+    // run out or after swapCandidateNum lookups; in between the top is scored
+    // again when it is taken and goes back if it dropped below the next, and a
+    // node which left Server B is dropped.
+    int findSwapCandidate(int serverBId, int serverAId, long long &maxSCBValue) {
+        auto &candidates = swapCandidates[(long long) serverBId << 32 | serverAId];
+        auto &heap = candidates.heap;
+        if (++candidates.lookupNum > swapCandidateNum) {
+            heap.clear();
+        }
+        while (!heap.empty()) {
+            pop_heap(heap.begin(), heap.end());
+            int nodeId = -heap.back().second;
+            heap.pop_back();
+            if (primaryServerIds[nodeId] != serverBId) continue;
+            pair<long long, int> candidate(findMaxSCB(nodeId, serverAId).first.value, -nodeId);
+            bool top = heap.empty() || candidate >= heap.front();
+            heap.emplace_back(candidate);
+            push_heap(heap.begin(), heap.end());
+            if (top) {
+                maxSCBValue = candidate.first;
+                return nodeId;
+            }
+        }
+
+        candidates.lookupNum = 0;
+        for (auto nodeId : servers[serverBId]->getPrimaryNodes()) {
+            heap.emplace_back(findMaxSCB(nodeId, serverAId).first.value, -nodeId);
+        }
+        if (heap.size() > swapCandidateNum) {
+            nth_element(heap.begin(), heap.begin() + swapCandidateNum - 1, heap.end(), greater<>());
+            heap.resize(swapCandidateNum);
+        }
+        if (heap.empty()) return -1;
+        make_heap(heap.begin(), heap.end());
+        maxSCBValue = heap.front().first;
+        return -heap.front().second;
+    }
+
     void validate() {
         for (auto &server : servers) {
             server->validate();
         }
     }
 
-    int computeInterServerCost() {
-        int cost = 0;
-        for (auto &server : servers) {
-            cost += server->computeInterServerCost();
-        }
-        return cost;
+    // the update traffic of all non-primary copies in bytes per second, which is
+    // their number if the nodes have no attributes
+    long long computeInterServerCost() const {
+        return interServerCost;
     }
 
-    int printCostAndTime() {
-        int cost = computeInterServerCost();
+    // print the cost and time at the end of a phase, iteration is the eta of the
+    // relocation phase and -1 for the others
+    long long printCostAndTime(const char *phase, int iteration = -1) {
+        long long cost = computeInterServerCost();
         auto end = chrono::system_clock::now();
         auto time = chrono::duration_cast<chrono::milliseconds>(end - start).count();
         cout << cost << "," << time << endl;
+        PROFILE_END(phase, iteration, cost);
         return cost;
     }
 
@@ -703,183 +1416,359 @@ public:
         }
     }
 
+    // split allNodes into ranges with about the same scoring work, which is the
+    // size of the neighbor server lists of the neighbors, so that a range of hubs
+    // is not one long task
+    vector<size_t> splitNodesByWork(size_t rangeNum) {
+        vector<long long> works(allNodes.size());
+        long long totalWork = 0;
+        for (size_t i = 0; i < allNodes.size(); i++) {
+            long long work = 1;
+            for (auto neighborId : getNeighbors(allNodes[i])) {
+                work += neighborServers[neighborId].size();
+            }
+            works[i] = work;
+            totalWork += work;
+        }
+
+        vector<size_t> ranges = {0};
+        long long rangeWork = 0, targetWork = totalWork / rangeNum + 1;
+        for (size_t i = 0; i < allNodes.size(); i++) {
+            rangeWork += works[i];
+            if (rangeWork >= targetWork) {
+                ranges.emplace_back(i + 1);
+                rangeWork = 0;
+            }
+        }
+        if (ranges.back() != allNodes.size()) {
+            ranges.emplace_back(allNodes.size());
+        }
+        return ranges;
+    }
+
     void reallocateAndSwapNode() {
-        vector<pair<int, int> > arr;
+        // the scoring pass only reads the placement, so the nodes are scored in
+        // parallel, each thread with its own histogram, and the results are kept
+        // in load order so the sorted candidates do not depend on the schedule
+        int threadNum = omp_get_max_threads();
+        vector<SCBHistogram> histograms(threadNum, SCBHistogram(servers.size()));
+        auto ranges = splitNodesByWork(threadNum * 16);
+        vector<long long> values(allNodes.size());
+#pragma omp parallel for schedule(dynamic, 1)
+        for (size_t rangeId = 0; rangeId < ranges.size() - 1; rangeId++) {
+            auto &histogram = histograms[omp_get_thread_num()];
+            for (size_t i = ranges[rangeId]; i < ranges[rangeId + 1]; i++) {
+                values[i] = findMaxSCB(allNodes[i], -1, histogram).first.value;
+            }
+        }
+
+        PROFILE_COUNT(findMaxSCBCalls, allNodes.size());
+
+        vector<pair<long long, int> > arr;
         arr.reserve(allNodes.size());
-        for (auto nodeId : allNodes) {
-            auto p = findMaxSCB(nodeId);
-            if (p.first.value > 0) {
-                arr.emplace_back(p.first.value, nodeId);
+        for (size_t i = 0; i < allNodes.size(); i++) {
+            if (values[i] > 0) {
+                arr.emplace_back(values[i], allNodes[i]);
             }
         }
         sort(arr.begin(), arr.end(), greater<>());
+        // the swap candidates are scored afresh in every pass
+        swapCandidates.clear();
         for (auto p : arr) {
             reallocateNode(p.second);
         }
     }
 
-    bool tryReBalance(int serverAId, int serverBId, int originCost) {
+    bool tryReBalance(int serverAId, int serverBId, long long originCost) {
+        PROFILE_SCOPE(reBalance);
         auto serverA = servers[serverAId].get();
         auto serverB = servers[serverBId].get();
-        int loadDiff = serverA->getLoad() - serverB->getLoad();
-        int newCost = serverA->computeInterServerCost() + serverB->computeInterServerCost();
+        long long newCost = serverA->computeInterServerCost() + serverB->computeInterServerCost();
         // return false if new cost is even larger
         if (newCost >= originCost) {
             return false;
         }
         // return true if already balanced
-        if (-loadConstraint <= loadDiff && loadDiff <= loadConstraint) {
+        if (isLoadBalanced(serverAId, serverA->getLoad(), serverBId, serverB->getLoad())) {
             return true;
         }
         // ensure we're moving from A to B
-        if (loadDiff < 0) {
+        if (getNormalizedLoad(serverAId, serverA->getLoad()) < getNormalizedLoad(serverBId, serverB->getLoad())) {
             swap(serverAId, serverBId);
             swap(serverA, serverB);
         }
-        auto singleNodes = serverA->getSingleNodes();
         // if server B have virtual primary, moving it have no effect on load
-        for (auto it = singleNodes.begin(); it != singleNodes.end();) {
-            auto nodeId = *it;
-            if (serverB->hasNode(nodeId) && serverB->getNode(nodeId).type == Server::NodeType::VIRTUAL_PRIMARY) {
-                it = singleNodes.erase(it);
-            } else {
-                ++it;
+        rebalanceCandidates.clear();
+        for (auto nodeId : serverA->getSingleNodes()) {
+            if (!isReplicaType(nodeId, serverBId, Server::NodeType::VIRTUAL_PRIMARY)) {
+                rebalanceCandidates.emplace_back(nodeId);
             }
         }
+        // the candidates are kept in a max-heap of (SCB toward Server B, -id), so
+        // ties go to the smallest id; a move only changes the SCB of the nodes
+        // within two hops of the moved node, which are re-scored, and the older
+        // heap entries of a node are skipped by its version
+        rebalanceHeap.clear();
+        auto score = [&](int nodeId) {
+            rebalanceHeap.emplace_back(findMaxSCB(nodeId, serverBId).first.value, -nodeId,
+                                       ++rebalanceVersions[nodeId]);
+            push_heap(rebalanceHeap.begin(), rebalanceHeap.end());
+        };
+        for (auto nodeId : rebalanceCandidates) {
+            rebalanceVersions[nodeId] = 0;
+            score(nodeId);
+        }
         vector<int> movedNodes;
-        while (!singleNodes.empty()) {
-            int maxSCBNodeId = -1;
-            SCBValue maxSCB;
-            maxSCB.value = numeric_limits<int>::min();
-            for (auto nodeId : singleNodes) {
-                auto p = findMaxSCB(nodeId, serverBId);
-                if (p.first.value > maxSCB.value) {
-                    maxSCB = p.first;
-                    maxSCBNodeId = nodeId;
-                }
-            }
-            if (originCost - newCost + maxSCB.value > 0) {
+        beginMoves();
+        while (!rebalanceHeap.empty()) {
+            pop_heap(rebalanceHeap.begin(), rebalanceHeap.end());
+            long long value;
+            int negativeNodeId, version;
+            tie(value, negativeNodeId, version) = rebalanceHeap.back();
+            rebalanceHeap.pop_back();
+            int maxSCBNodeId = -negativeNodeId;
+            if (version != rebalanceVersions[maxSCBNodeId]) continue;
+            if (originCost - newCost + value > 0) {
                 movedNodes.emplace_back(maxSCBNodeId);
-                singleNodes.erase(maxSCBNodeId);
+                rebalanceVersions[maxSCBNodeId] = -1;
                 moveNode(maxSCBNodeId, serverBId);
                 newCost = serverA->computeInterServerCost() + serverB->computeInterServerCost();
+
+                ++rebalanceStamp;
+                for (auto neighborId : getNeighbors(maxSCBNodeId)) {
+                    for (auto nodeId : getNeighbors(neighborId)) {
+                        if (rebalanceVersions[nodeId] >= 0 && rebalanceStamps[nodeId] != rebalanceStamp) {
+                            rebalanceStamps[nodeId] = rebalanceStamp;
+                            score(nodeId);
+                        }
+                    }
+                    if (rebalanceVersions[neighborId] >= 0 && rebalanceStamps[neighborId] != rebalanceStamp) {
+                        rebalanceStamps[neighborId] = rebalanceStamp;
+                        score(neighborId);
+                    }
+                }
             } else break;
         }
+        for (auto nodeId : rebalanceCandidates) {
+            rebalanceVersions[nodeId] = -1;
+        }
         // examine the result
-        loadDiff = serverA->getLoad() - serverB->getLoad();
         newCost = serverA->computeInterServerCost() + serverB->computeInterServerCost();
-        if (-loadConstraint <= loadDiff && loadDiff <= loadConstraint && newCost < originCost) {
+        if (isLoadBalanced(serverAId, serverA->getLoad(), serverBId, serverB->getLoad()) && newCost < originCost) {
             // update the single nodes
             for (auto nodeId : movedNodes) {
                 serverA->getSingleNodes().erase(nodeId);
                 serverB->getSingleNodes().emplace(nodeId);
             }
+            commitMoves();
 //            cout << "rebalance move " << movedNodes.size() << " nodes from server " << serverAId << " to " << serverBId;
 //            cout << ", cost " << originCost << " -> " << newCost << endl;
             return true;
         }
         // if load balance failed, reverse the operations
-        for (auto nodeId : movedNodes) {
-            moveNode(nodeId, serverAId);
-        }
+        abortMoves();
 //        cout << "rebalance failed" << endl;
         return false;
     }
 
     void mergeNodes() {
+        // servers only read the graph while coarsening, so they run in parallel,
+        // each thread with its own arena; the random stream of every server is
+        // seeded from the master generator in server order, so the groups do not
+        // depend on the schedule
+        vector<mt19937::result_type> seeds(servers.size());
+        for (auto &seed : seeds) {
+            seed = randomGenerator();
+        }
+        mergedGraphs.resize(omp_get_max_threads());
+#pragma omp parallel for schedule(dynamic, 1)
+        for (size_t serverId = 0; serverId < servers.size(); serverId++) {
+            mt19937 generator(seeds[serverId]);
+            servers[serverId]->mergeNodes(mergedGraphs[omp_get_thread_num()], generator);
+        }
         for (auto &server : servers) {
-            server->mergeNodes(randomGenerator);
-            int serverId = server->getId();
             auto &groupedNodes = server->getGroupedNodes();
-            for (auto &nodeIds : groupedNodes) {
-                mergedNodes.emplace(nodeIds);
+            mergedNodes.insert(mergedNodes.end(), groupedNodes.begin(), groupedNodes.end());
+        }
+        sort(mergedNodes.begin(), mergedNodes.end(), MergedNodeCompare());
+        groupIds.assign(allNodes.size(), -1);
+        for (size_t groupId = 0; groupId < mergedNodes.size(); groupId++) {
+            for (auto nodeId : mergedNodes[groupId].nodeIds) {
+                groupIds[nodeId] = groupId;
             }
         }
+        swapDeltas.assign(allNodes.size(), 0);
+        swapMarks.assign(allNodes.size(), false);
+        rebalanceVersions.assign(allNodes.size(), -1);
+        rebalanceStamps.assign(allNodes.size(), 0);
+
+        // a group A is paired with the groups B after it in MergedNodeCompare order,
+        // as long as they are at most loadConstraint smaller and up to the first
+        // one on the server of A; a swap which does not cut the copies on the two
+        // servers is rejected by tryReBalance before it rebalances, so such pairs
+        // are skipped from the exact estimate instead of being moved and undone
         int count = 0;
-        for (auto itA = mergedNodes.begin(); itA != mergedNodes.end(); ++itA) {
-            int serverAId = getNode(itA->front()).GetDat().primaryServerId;
-            auto serverA = servers[serverAId].get();
-
-            auto itB = itA;
-            while (++itB != mergedNodes.end()) {
-                if (itA->size() - itB->size() > loadConstraint) break;
-                int serverBId = getNode(itB->front()).GetDat().primaryServerId;
+        for (size_t groupAId = 0; groupAId < mergedNodes.size(); groupAId++) {
+            auto &groupA = mergedNodes[groupAId].nodeIds;
+            for (size_t groupBId = groupAId + 1; groupBId < mergedNodes.size(); groupBId++) {
+                auto &groupB = mergedNodes[groupBId].nodeIds;
+                if (groupA.size() - groupB.size() > loadConstraint) break;
+                int serverAId = primaryServerIds[groupA.front()];
+                int serverBId = primaryServerIds[groupB.front()];
                 if (serverAId == serverBId) break;
+                auto serverA = servers[serverAId].get();
                 auto serverB = servers[serverBId].get();
+                long long swapCost = estimateSwapCost(groupAId, groupBId, serverAId, serverBId);
+                if (swapCost >= 0) {
+                    // a tried pair leaves its single-node groups in the single nodes
+                    // of their current servers (which may not have held them), so a
+                    // skipped pair does too
+                    if (groupA.size() == 1) {
+                        serverA->getSingleNodes().emplace(groupA[0]);
+                    }
+                    if (groupB.size() == 1) {
+                        serverB->getSingleNodes().emplace(groupB[0]);
+                    }
+                    continue;
+                }
 
-                int originCost = serverA->computeInterServerCost() + serverB->computeInterServerCost();
-                for (auto nodeId : *itA) {
+                long long originCost = serverA->computeInterServerCost() + serverB->computeInterServerCost();
+                beginMoves();
+                for (auto nodeId : groupA) {
                     moveNode(nodeId, serverBId);
                 }
-                for (auto nodeId : *itB) {
+                for (auto nodeId : groupB) {
                     moveNode(nodeId, serverAId);
                 }
+                // the estimate is the first check of tryReBalance
+                assert(serverA->computeInterServerCost() + serverB->computeInterServerCost() ==
+                       originCost + swapCost);
 
-                if (itA->size() == 1) {
-                    serverA->getSingleNodes().erase((*itA)[0]);
+                if (groupA.size() == 1) {
+                    serverA->getSingleNodes().erase(groupA[0]);
                 }
-                if (itB->size() == 1) {
-                    serverB->getSingleNodes().erase((*itB)[0]);
+                if (groupB.size() == 1) {
+                    serverB->getSingleNodes().erase(groupB[0]);
                 }
 
                 bool flag = tryReBalance(serverAId, serverBId, originCost);
 
-                if (itA->size() == 1) {
-                    serverA->getSingleNodes().emplace((*itA)[0]);
+                if (groupA.size() == 1) {
+                    serverA->getSingleNodes().emplace(groupA[0]);
                 }
-                if (itB->size() == 1) {
-                    serverB->getSingleNodes().emplace((*itB)[0]);
+                if (groupB.size() == 1) {
+                    serverB->getSingleNodes().emplace(groupB[0]);
                 }
-//                if (newCost < originCost) {
-//                    cout << "swap " << itA->size() << " nodes from server " << serverAId;
-//                    cout << " and " << itB->size() << " nodes from server " << serverBId;
-//                    cout << ", cost " << originCost << " -> " << newCost << endl;
-//                }
                 if (!flag) {
-                    for (auto nodeId : *itA) {
-                        moveNode(nodeId, serverAId);
-                    }
-                    for (auto nodeId : *itB) {
-                        moveNode(nodeId, serverBId);
-                    }
+                    abortMoves();
                 } else {
+                    commitMoves();
                     ++count;
                 }
             }
         }
     }
 
-    void getSwappableVirtualPrimary(int serverAId, int serverBId, vector<int> &nodes) {
-        auto serverA = servers[serverAId].get();
-        auto serverB = servers[serverBId].get();
-        for (auto nodeId : serverA->getVirtualPrimaryNodes()) {
-            if (serverB->hasNode(nodeId) && serverB->getNode(nodeId).type == Server::NodeType::NON_PRIMARY) {
-                auto &node = getNode(nodeId);
-                auto neighborNum = node.GetDeg();
-                bool flag = true;
-                for (int i = 0; i < neighborNum; i++) {
-                    int neighborId = node.GetNbrNId(i);
-                    if (getNode(neighborId).GetDat().primaryServerId == serverAId) {
-                        flag = false;
-                        break;
-                    }
-                }
-                if (flag) {
-                    nodes.emplace_back(nodeId);
+    // the change of the update traffic of the non-primary copies on server A and
+    // server B if the groups swap their servers; a node needs a copy on a server
+    // holding a primary of its neighbors unless the server holds its primary or
+    // virtual primary
+    long long estimateSwapCost(int groupAId, int groupBId, int serverAId, int serverBId) {
+        // the change of the neighbors on server A, the opposite of server B
+        auto touch = [&](int nodeId, int delta) {
+            if (!swapMarks[nodeId]) {
+                swapMarks[nodeId] = true;
+                swapNodes.emplace_back(nodeId);
+            }
+            swapDeltas[nodeId] += delta;
+        };
+        for (auto nodeId : mergedNodes[groupAId].nodeIds) {
+            touch(nodeId, 0);
+            for (auto neighborId : getNeighbors(nodeId)) {
+                touch(neighborId, -1);
+            }
+        }
+        for (auto nodeId : mergedNodes[groupBId].nodeIds) {
+            touch(nodeId, 0);
+            for (auto neighborId : getNeighbors(nodeId)) {
+                touch(neighborId, 1);
+            }
+        }
+        long long cost = 0;
+        for (auto nodeId : swapNodes) {
+            int serverId = primaryServerIds[nodeId];
+            if (serverId >= 0) {
+                int newServerId = serverId;
+                if (groupIds[nodeId] == groupAId) newServerId = serverBId;
+                else if (groupIds[nodeId] == groupBId) newServerId = serverAId;
+                bool onA = isReplicaType(nodeId, serverAId, Server::NodeType::VIRTUAL_PRIMARY);
+                bool onB = isReplicaType(nodeId, serverBId, Server::NodeType::VIRTUAL_PRIMARY);
+                int neighborANum = getNeighborServerNum(nodeId, serverAId);
+                int neighborBNum = getNeighborServerNum(nodeId, serverBId);
+                int copyNum = (neighborANum > 0 && serverId != serverAId && !onA) +
+                              (neighborBNum > 0 && serverId != serverBId && !onB);
+                // a moved node swaps its primary with the virtual primary on the target
+                if (newServerId != serverId) swap(onA, onB);
+                neighborANum += swapDeltas[nodeId];
+                neighborBNum -= swapDeltas[nodeId];
+                copyNum -= (neighborANum > 0 && newServerId != serverAId && !onA) +
+                           (neighborBNum > 0 && newServerId != serverBId && !onB);
+                cost -= (long long) copyNum * updateTraffics[nodeId];
+            }
+            swapMarks[nodeId] = false;
+            swapDeltas[nodeId] = 0;
+        }
+        swapNodes.clear();
+        return cost;
+    }
+
+    // queue the node for every pair (Server A, Server B) it can be swapped on: it is
+    // a virtual primary on Server A, none of its neighbors is on Server A, and
+    // Server B holds a non-primary copy of it
+    void queueSwappableVirtualPrimary(int nodeId, int serverAId, vector<vector<int> > &queues) {
+        if (getNeighborServerNum(nodeId, serverAId) > 0) return;
+        for (auto &replica : replicas[nodeId]) {
+            if (replica.type == Server::NodeType::NON_PRIMARY) {
+                auto &queue = queues[serverAId * servers.size() + replica.serverId];
+                auto it = lower_bound(queue.begin(), queue.end(), nodeId);
+                if (it == queue.end() || *it != nodeId) {
+                    queue.emplace(it, nodeId);
                 }
             }
         }
     }
 
+    // the queued nodes still swappable on (Server A, Server B), the others are dropped
+    void getSwappableVirtualPrimary(int serverAId, int serverBId, vector<vector<int> > &queues,
+                                    vector<int> &nodes) {
+        auto &queue = queues[serverAId * servers.size() + serverBId];
+        queue.erase(remove_if(queue.begin(), queue.end(), [&](int nodeId) {
+            return !isReplicaType(nodeId, serverAId, Server::NodeType::VIRTUAL_PRIMARY) ||
+                   !isReplicaType(nodeId, serverBId, Server::NodeType::NON_PRIMARY);
+        }), queue.end());
+        nodes.assign(queue.begin(), queue.end());
+    }
+
     void virtualPrimarySwapping() {
+        // primaries do not move in this phase, so the swappable virtual primaries of
+        // all server pairs are queued in one pass, in ascending order of node ids, and
+        // a swap only changes the queues of the two swapped nodes
+        vector<vector<int> > queues(servers.size() * servers.size());
+        for (int nodeId = 0; nodeId < replicas.size(); nodeId++) {
+            for (auto &replica : replicas[nodeId]) {
+                if (replica.type == Server::NodeType::VIRTUAL_PRIMARY) {
+                    queueSwappableVirtualPrimary(nodeId, replica.serverId, queues);
+                }
+            }
+        }
+        vector<int> nodesA, nodesB;
         for (int serverAId = 0; serverAId < servers.size(); serverAId++) {
             auto serverA = servers[serverAId].get();
             for (int serverBId = 0; serverBId < servers.size(); serverBId++) {
                 if (serverAId == serverBId) continue;
                 auto serverB = servers[serverBId].get();
-                vector<int> nodesA, nodesB;
-                getSwappableVirtualPrimary(serverAId, serverBId, nodesA);
-                getSwappableVirtualPrimary(serverBId, serverAId, nodesB);
+                getSwappableVirtualPrimary(serverAId, serverBId, queues, nodesA);
+                getSwappableVirtualPrimary(serverBId, serverAId, queues, nodesB);
                 auto removeNum = min(nodesA.size(), nodesB.size());
                 for (int i = 0; i < removeNum; i++) {
                     int nodeAId = nodesA[i];
@@ -893,143 +1782,165 @@ public:
 //                    cout << "server " << serverAId << " " << nodeAId << " (V) " << nodeBId << " (N), ";
 //                    cout << "server " << serverBId << " " << nodeBId << " (V) " << nodeAId << " (N)" << endl;
                 }
+                for (int i = 0; i < removeNum; i++) {
+                    queueSwappableVirtualPrimary(nodesA[i], serverBId, queues);
+                    queueSwappableVirtualPrimary(nodesB[i], serverAId, queues);
+                }
             }
         }
     }
 
+    void initSPAR() {
+        sparScratches.resize(omp_get_max_threads());
+        for (auto &scratch : sparScratches) {
+            scratch.marks.assign(allNodes.size(), 0);
+        }
+
+        sparEdges.resize(max(sparBatchSize, (size_t) 1));
+        sparBatchMarks.assign(allNodes.size(), 0);
+        sparNeighborMarks.assign(allNodes.size(), 0);
+    }
+
     void runSPAR() {
-        for (auto node = rawGraph->BegNI(); node != rawGraph->EndNI(); node++) {
-            int nodeId = node.GetId();
+        initSPAR();
+
+        for (auto nodeId : allNodes) {
             addNode(nodeId);
         }
 
-        // SPAR's edge addition
-        for (auto edge = rawGraph->BegEI(); edge != rawGraph->EndEI(); edge++) {
-            int nodeId = edge.GetSrcNId();
-            int neighborId = edge.GetDstNId();
-            if (nodeId == neighborId) continue;
-            auto &neighborNode = getNode(neighborId);
-            if (neighborNode.GetDat().primaryServerId >= 0 && !isEdge(nodeId, neighborId)) {
-                graph->AddEdge(nodeId, neighborId);
-                addEdgeSPAR(nodeId, neighborId);
+        // SPAR's edge addition, each undirected edge is loaded once
+        if (sparBatchSize <= 1) {
+            for (auto &edge : allEdges) {
+                int nodeId = edge.nodeAId;
+                int neighborId = edge.nodeBId;
+                if (primaryServerIds[neighborId] >= 0) {
+                    addEdge(nodeId, neighborId);
+                    addEdgeSPAR(nodeId, neighborId);
+                }
+            }
+        } else {
+            size_t staleNum = 0;
+            for (size_t i = 0; i < allEdges.size(); i += sparBatchSize) {
+                staleNum += addEdgesSPAR(allEdges.begin() + i, min(sparBatchSize, allEdges.size() - i));
+            }
+            if (verbose) {
+                cerr << "spar batch " << sparBatchSize << ": " << staleNum << " of " << allEdges.size()
+                     << " edges re-evaluated" << endl;
             }
         }
 
-        printCostAndTime();
+        printCostAndTime("placement");
 
     }
 
     void runMetis() {
-        idx_t nVertices = rawGraph->GetNodes();
-        idx_t nEdges = rawGraph->GetEdges();
+        idx_t nVertices = allNodes.size();
         idx_t nWeights = 1;
         idx_t nParts = servers.size();
 
         idx_t objval;
         vector<idx_t> part(nVertices);
 
+        // METIS numbers the nodes in load order, its partition depends on the numbering
+        vector<idx_t> metisNodeIds(nVertices);
+        for (idx_t i = 0; i < nVertices; i++) {
+            metisNodeIds[allNodes[i]] = i;
+        }
+
         vector<idx_t> xadj;
         xadj.reserve(nVertices + 1);
         vector<idx_t> adjncy;
-        adjncy.reserve(nEdges * 2);
+        adjncy.reserve(adjacency.size());
+        // the edges are weighted by their interaction frequency if the graph has them
+        vector<idx_t> adjwgt;
+        adjwgt.reserve(adjacencyWeights.size());
 
-        idx_t current = 0;
-        unordered_map<int, int> nodeIdMap;
-
-        int nodeIdCount = 0;
-        for (auto node = rawGraph->BegNI(); node != rawGraph->EndNI(); node++) {
-            int nodeId = node.GetId();
-            nodeIdMap.emplace(nodeId, nodeIdCount++);
-        }
-
-        for (auto node = rawGraph->BegNI(); node != rawGraph->EndNI(); node++) {
-            int nodeId = nodeIdMap[node.GetId()];
-            xadj.emplace_back(current);
-            auto neighborNum = node.GetDeg();
-            for (int i = 0; i < neighborNum; i++) {
-                int neighborId = nodeIdMap[node.GetNbrNId(i)];
-                if (nodeId == neighborId) continue;
-                adjncy.emplace_back(neighborId);
-                current++;
+        for (auto nodeId : allNodes) {
+            xadj.emplace_back(adjncy.size());
+            for (int i = adjacencyOffsets[nodeId]; i < adjacencyOffsets[nodeId + 1]; i++) {
+                adjncy.emplace_back(metisNodeIds[adjacency[i]]);
+                if (!adjacencyWeights.empty()) {
+                    adjwgt.emplace_back(adjacencyWeights[i]);
+                }
             }
         }
-        xadj.emplace_back(current);
+        xadj.emplace_back(adjncy.size());
 
         assert(xadj.size() == nVertices + 1);
-        assert(adjncy.size() == nEdges * 2);
+        assert(adjncy.size() == allEdges.size() * 2);
+
+        // the parts are sized by the capacities, unless all of them are the same
+        vector<real_t> partWeights;
+        if (any_of(capacities.begin(), capacities.end(), [&](int capacity) { return capacity != capacities[0]; })) {
+            int capacitySum = accumulate(capacities.begin(), capacities.end(), 0);
+            for (auto capacity : capacities) {
+                partWeights.emplace_back((real_t) capacity / capacitySum);
+            }
+        }
 
         int ret = METIS_PartGraphKway(&nVertices, &nWeights, xadj.data(), adjncy.data(),
-                                      nullptr, nullptr, nullptr, &nParts, nullptr,
+                                      nullptr, nullptr, adjwgt.empty() ? nullptr : adjwgt.data(), &nParts,
+                                      partWeights.empty() ? nullptr : partWeights.data(),
                                       nullptr, nullptr, &objval, part.data());
 
-        for (auto node = graph->BegNI(); node != graph->EndNI(); node++) {
-            int nodeId = node.GetId();
-            int metisNodeId = nodeIdMap[nodeId];
-            int serverId = part[metisNodeId];
+        for (auto nodeId : allNodes) {
+            int serverId = part[metisNodeIds[nodeId]];
             auto server = servers[serverId].get();
             server->addNode(nodeId, Server::NodeType::PRIMARY);
-            node.GetDat().primaryServerId = serverId;
+            primaryServerIds[nodeId] = serverId;
         }
 
-        for (auto node = graph->BegNI(); node != graph->EndNI(); node++) {
-            int nodeId = node.GetId();
-            auto it = serverSet.begin();
+        for (auto nodeId : allNodes) {
             vector<int> virtualPrimaryServerIds;
-            for (; virtualPrimaryServerIds.size() < virtualPrimaryNum; ++it) {
-                if (!(*it)->hasNode(nodeId)) {
-                    virtualPrimaryServerIds.emplace_back((*it)->getId());
+            loadIndex.visit([&](int serverId) {
+                if (virtualPrimaryServerIds.size() >= virtualPrimaryNum) return false;
+                if (!getReplica(nodeId, serverId)) {
+                    virtualPrimaryServerIds.emplace_back(serverId);
                 }
-            }
+                return true;
+            });
             for (auto virtualPrimaryServerId : virtualPrimaryServerIds) {
                 auto virtualPrimaryServer = servers[virtualPrimaryServerId].get();
                 virtualPrimaryServer->addNode(nodeId, Server::NodeType::VIRTUAL_PRIMARY);
             }
-            node.GetDat().virtualPrimaryNum = virtualPrimaryNum;
+            virtualPrimaryNums[nodeId] = virtualPrimaryNum;
         }
 
-        for (auto edge = rawGraph->BegEI(); edge != rawGraph->EndEI(); edge++) {
-            int nodeId = edge.GetSrcNId();
-            int neighborId = edge.GetDstNId();
-            if (nodeId == neighborId) continue;
-            auto &node = getNode(nodeId);
-            auto &neighbor = getNode(neighborId);
-            auto nodeServer = servers[node.GetDat().primaryServerId].get();
-            auto neighborServer = servers[neighbor.GetDat().primaryServerId].get();
-            if (neighbor.GetDat().primaryServerId >= 0 && !isEdge(nodeId, neighborId)) {
-                graph->AddEdge(nodeId, neighborId);
+        for (auto &edge : allEdges) {
+            int nodeId = edge.nodeAId;
+            int neighborId = edge.nodeBId;
+            int nodeServerId = primaryServerIds[nodeId];
+            int neighborServerId = primaryServerIds[neighborId];
+            if (neighborServerId >= 0) {
+                addEdge(nodeId, neighborId);
 //                addEdgeSPAR(nodeId, neighborId);
-                if (!nodeServer->hasNode(neighborId)) {
-                    nodeServer->addNode(neighborId, Server::NodeType::NON_PRIMARY);
-//                    neighbor.GetDat().virtualPrimaryNum++;
+                if (!getReplica(neighborId, nodeServerId)) {
+                    servers[nodeServerId]->addNode(neighborId, Server::NodeType::NON_PRIMARY);
+//                    virtualPrimaryNums[neighborId]++;
                 }
-                if (!neighborServer->hasNode(nodeId)) {
-                    neighborServer->addNode(nodeId, Server::NodeType::NON_PRIMARY);
-//                    node.GetDat().virtualPrimaryNum++;
+                if (!getReplica(nodeId, neighborServerId)) {
+                    servers[neighborServerId]->addNode(nodeId, Server::NodeType::NON_PRIMARY);
+//                    virtualPrimaryNums[nodeId]++;
                 }
             }
         }
 
-        printCostAndTime();
+        printCostAndTime("placement");
 
         // virtual primary swapping
         virtualPrimarySwapping();
 
-        printCostAndTime();
+        printCostAndTime("swapping");
     }
 
     void runProposed(bool random = false, bool offline = true) {
-        for (auto node = rawGraph->BegNI(); node != rawGraph->EndNI(); node++) {
-            int nodeId = node.GetId();
+        for (auto nodeId : allNodes) {
             addNode(nodeId);
 
-            // ensure locality
-            auto neighborNum = node.GetDeg();
-            for (int i = 0; i < neighborNum; i++) {
-                int neighborId = node.GetNbrNId(i);
-                if (nodeId == neighborId) continue;
-                auto &neighborNode = getNode(neighborId);
-                if (neighborNode.GetDat().primaryServerId >= 0 && !isEdge(nodeId, neighborId)) {
-                    graph->AddEdge(nodeId, neighborId);
+            // ensure locality, the edges to the nodes added before are new
+            for (auto neighborId : getAdjacency(nodeId)) {
+                if (primaryServerIds[neighborId] >= 0) {
+                    addEdge(nodeId, neighborId);
                     ensureLocality(nodeId, neighborId);
                 }
             }
@@ -1040,14 +1951,14 @@ public:
             }
         }
 
-        int cost = printCostAndTime();
+        long long cost = printCostAndTime("placement");
 
         if (random || !offline) return;
 
         // node relocation and swapping
         for (int eta = 0; eta < 5; eta++) {
             reallocateAndSwapNode();
-            int newCost = printCostAndTime();
+            long long newCost = printCostAndTime("reallocate", eta);
             if (cost - newCost < 50) {
                 break;
             }
@@ -1057,16 +1968,749 @@ public:
         // merge nodes
         mergeNodes();
 
-        printCostAndTime();
+        printCostAndTime("merge");
 
         // virtual primary swapping
         virtualPrimarySwapping();
 
-        printCostAndTime();
+        printCostAndTime("swapping");
+    }
+
+    // copies made and dropped by a change of the cluster, a primary or virtual
+    // primary turning into a non-primary copy on the same server is not counted
+    struct MigrationReport {
+        size_t copiedReplicas = 0;
+        size_t droppedReplicas = 0;
+        size_t movedPrimaries = 0;
+        // the size of the copied replicas, a primary moved onto a server which
+        // had no copy of it is one of them
+        double copiedBytes = 0;
+    };
+
+    struct FailureReport {
+        size_t promotedPrimaries = 0;
+        // nodes without any surviving copy, placed again from scratch
+        size_t lostNodes = 0;
+        size_t copiedReplicas = 0;
+        double copiedBytes = 0;
+        // the most tasks a server runs, which bounds the recovery time
+        int maxTaskNum = 0;
+        // the largest normalized load of the survivors over their mean
+        double loadRatio = 0;
+    };
+
+    // the least loaded server which holds neither the primary nor a virtual
+    // primary of the node (any server if nodeId < 0), -1 if there is none
+    int findLeastLoadedServer(int nodeId = -1) {
+        int leastLoadedServerId = -1;
+        loadIndex.visit([&](int serverId) {
+            if (removedServerMarks[serverId] ||
+                (nodeId >= 0 && getReplica(nodeId, serverId) &&
+                 getReplica(nodeId, serverId)->type != Server::NodeType::NON_PRIMARY)) {
+                return true;
+            }
+            leastLoadedServerId = serverId;
+            return false;
+        });
+        return leastLoadedServerId;
+    }
+
+    // The gain in inter-server cost of moving the primary (type PRIMARY) or a
+    // virtual primary of the node from Server A to Server B, and the load it adds
+    // to Server B; numeric_limits<long long>::min() if the copy is not on Server A or it
+    // can not take load to Server B. A primary is scored with SCB, or with the
+    // SPAR configuration for SPAR. A virtual primary leaves a non-primary copy if
+    // a neighbor on Server A needs it, which SPAR does not allow.
+    long long calculateMoverGain(int nodeId, Server::NodeType type, int serverAId, int serverBId, int &loadDelta) {
+        auto replicaA = getReplica(nodeId, serverAId);
+        auto replicaB = getReplica(nodeId, serverBId);
+        if (!replicaA || replicaA->type != type) {
+            return numeric_limits<long long>::min();
+        }
+        loadDelta = 1;
+        if (type == Server::NodeType::PRIMARY) {
+            // the primary would be swapped with the virtual primary on Server B
+            if (replicaB && replicaB->type == Server::NodeType::VIRTUAL_PRIMARY) {
+                return numeric_limits<long long>::min();
+            }
+            if (algorithm == Algorithm::SPAR) {
+                calculateSPAR(nodeId, serverBId, -1, moverSPAR, sparScratches[0]);
+                loadDelta = moverSPAR.serverBDelta;
+                return -moverSPAR.trafficDelta;
+            }
+            return calculateSCB(nodeId, serverBId).value;
+        }
+        if (replicaB && replicaB->type != Server::NodeType::NON_PRIMARY) {
+            return numeric_limits<long long>::min();
+        }
+        bool neededOnA = getNeighborServerNum(nodeId, serverAId) > 0;
+        if (neededOnA && algorithm == Algorithm::SPAR) {
+            return numeric_limits<long long>::min();
+        }
+        return (long long) (((int) !neededOnA) - ((int) !replicaB)) * updateTraffics[nodeId];
+    }
+
+    void moveVirtualPrimary(int nodeId, int serverAId, int serverBId) {
+        servers[serverAId]->removeNode(nodeId);
+        if (getNeighborServerNum(nodeId, serverAId) > 0) {
+            servers[serverAId]->addNode(nodeId, Server::NodeType::NON_PRIMARY);
+        }
+        if (getReplica(nodeId, serverBId)) {
+            servers[serverBId]->removeNode(nodeId);
+        }
+        servers[serverBId]->addNode(nodeId, Server::NodeType::VIRTUAL_PRIMARY);
+    }
+
+    void applyMover(int nodeId, Server::NodeType type, int serverAId, int serverBId) {
+        if (type == Server::NodeType::VIRTUAL_PRIMARY) {
+            moveVirtualPrimary(nodeId, serverAId, serverBId);
+        } else if (algorithm == Algorithm::SPAR) {
+            calculateSPAR(nodeId, serverBId, -1, moverSPAR, sparScratches[0]);
+            applySPAR(moverSPAR, nodeId, serverBId);
+        } else {
+            moveNode(nodeId, serverBId);
+        }
+    }
+
+    // Moves primaries and virtual primaries from the most to the least loaded
+    // server until the loads are within loadConstraint. The movers of a server
+    // are scored once for a target server and kept in a max-heap, the top is
+    // scored again when it is taken and goes back if it dropped below the next.
+    // A constraint no mover can reach, such as 0 for loads that do not divide
+    // evenly, stops when the most loaded server has nothing left to move.
+    void balanceLoads() {
+        moverHeaps.resize(servers.size());
+        moverHeapMarks.assign(servers.size(), false);
+        moverServerId = -1;
+        while (true) {
+            int serverAId = -1;
+            loadIndex.visitDescending([&](int serverId) {
+                serverAId = serverId;
+                return false;
+            });
+            int serverBId = findLeastLoadedServer();
+            int loadA = loadIndex.getLoad(serverAId), loadB = loadIndex.getLoad(serverBId);
+            if (getNormalizedLoad(serverAId, loadA) - getNormalizedLoad(serverBId, loadB) <= loadConstraint) {
+                break;
+            }
+
+            if (serverBId != moverServerId) {
+                moverHeapMarks.assign(servers.size(), false);
+                moverServerId = serverBId;
+            }
+            auto &heap = moverHeaps[serverAId];
+            if (!moverHeapMarks[serverAId]) {
+                moverHeapMarks[serverAId] = true;
+                heap.clear();
+                auto server = servers[serverAId].get();
+                for (auto type : {Server::NodeType::PRIMARY, Server::NodeType::VIRTUAL_PRIMARY}) {
+                    auto &nodeIds = type == Server::NodeType::PRIMARY ? server->getPrimaryNodes()
+                                                                       : server->getVirtualPrimaryNodes();
+                    for (auto nodeId : nodeIds) {
+                        int loadDelta;
+                        long long gain = calculateMoverGain(nodeId, type, serverAId, serverBId, loadDelta);
+                        if (gain != numeric_limits<long long>::min()) {
+                            heap.emplace_back(gain, -nodeId, (int) type);
+                        }
+                    }
+                }
+                make_heap(heap.begin(), heap.end());
+            }
+
+            bool moved = false;
+            while (!heap.empty()) {
+                pop_heap(heap.begin(), heap.end());
+                auto mover = heap.back();
+                heap.pop_back();
+                int nodeId = -get<1>(mover);
+                auto type = (Server::NodeType) get<2>(mover);
+                int loadDelta;
+                long long gain = calculateMoverGain(nodeId, type, serverAId, serverBId, loadDelta);
+                // a mover must not leave Server B more loaded than Server A was
+                if (gain == numeric_limits<long long>::min() ||
+                    getNormalizedLoad(serverBId, loadB + loadDelta) >= getNormalizedLoad(serverAId, loadA)) {
+                    continue;
+                }
+                if (!heap.empty() && gain < get<0>(heap.front())) {
+                    heap.emplace_back(gain, -nodeId, (int) type);
+                    push_heap(heap.begin(), heap.end());
+                    continue;
+                }
+                applyMover(nodeId, type, serverAId, serverBId);
+                moved = true;
+                break;
+            }
+            if (!moved) {
+                cerr << "can not balance the load of server " << serverAId << endl;
+                break;
+            }
+        }
+    }
+
+    // the net change since the outermost open transaction, read from its undo log
+    MigrationReport reportMigration() {
+        assert(moveLogMarks.size() == 1);
+        MigrationReport report;
+        // (node, server, order) of the copies added or removed; the first change of
+        // a copy tells whether it was there before
+        vector<tuple<int, int, size_t> > changes;
+        vector<pair<int, int> > moves;
+        for (size_t i = moveLogMarks.back(); i < moveLog.size(); i++) {
+            auto &entry = moveLog[i];
+            if (entry.type == MoveLogEntry::Type::MOVE) {
+                moves.emplace_back(entry.nodeId, entry.serverId);
+            } else {
+                changes.emplace_back(entry.nodeId, entry.serverId, i);
+            }
+        }
+        sort(changes.begin(), changes.end());
+        for (size_t i = 0; i < changes.size(); i++) {
+            int nodeId = get<0>(changes[i]), serverId = get<1>(changes[i]);
+            if (i > 0 && get<0>(changes[i - 1]) == nodeId && get<1>(changes[i - 1]) == serverId) continue;
+            bool before = moveLog[get<2>(changes[i])].type == MoveLogEntry::Type::REMOVE_REPLICA;
+            bool after = getReplica(nodeId, serverId) != nullptr;
+            report.copiedReplicas += (int) (!before && after);
+            if (!before && after) {
+                report.copiedBytes += nodeSizes[nodeId];
+            }
+            report.droppedReplicas += (int) (before && !after);
+        }
+        // the first move of a node holds its server before
+        stable_sort(moves.begin(), moves.end(), [](const pair<int, int> &a, const pair<int, int> &b) {
+            return a.first < b.first;
+        });
+        for (size_t i = 0; i < moves.size(); i++) {
+            if (i > 0 && moves[i - 1].first == moves[i].first) continue;
+            report.movedPrimaries += (int) (primaryServerIds[moves[i].first] != moves[i].second);
+        }
+        return report;
+    }
+
+    // print the migration of a change of the cluster as
+    //   copied replicas,dropped replicas,moved primaries,copied bytes
+    void printMigration(const MigrationReport &report) {
+        cout << report.copiedReplicas << "," << report.droppedReplicas << "," << report.movedPrimaries << ","
+             << report.copiedBytes << endl;
+    }
+
+    // Adds an empty server and moves load to it until the loads are within
+    // loadConstraint again, returns its id.
+    int addServer() {
+        int serverId = (int) servers.size();
+        beginMoves();
+        servers.emplace_back(make_unique<Server>(serverId, this));
+        removedServerMarks.emplace_back(false);
+        capacities.emplace_back(1);
+        loadIndex.addServer(1);
+        scbHistogram.entries.resize(servers.size());
+        balanceLoads();
+        printMigration(reportMigration());
+        commitMoves();
+        printCostAndTime("add server");
+        return serverId;
+    }
+
+    // Removes a server: its primaries go to the servers with the largest gain
+    // among those within loadConstraint of the least loaded one, its virtual
+    // primaries go to the least loaded servers without a copy of the node (or are
+    // dropped if the node has more than k), its non-primary copies are dropped,
+    // and the loads are balanced again.
+    void removeServer(int serverId) {
+        assert(!removedServerMarks[serverId]);
+        assert(count(removedServerMarks.begin(), removedServerMarks.end(), false) > virtualPrimaryNum + 1);
+        beginMoves();
+        removedServerMarks[serverId] = true;
+
+        vector<int> nodeIds(servers[serverId]->getPrimaryNodes().begin(), servers[serverId]->getPrimaryNodes().end());
+        for (auto nodeId : nodeIds) {
+            int leastLoadedServerId = findLeastLoadedServer();
+            double minLoad = getNormalizedLoad(leastLoadedServerId, loadIndex.getLoad(leastLoadedServerId));
+            int targetServerId = -1;
+            long long maxGain = numeric_limits<long long>::min();
+            auto tryServer = [&](int serverBId) {
+                int loadDelta;
+                if (serverBId < 0 || removedServerMarks[serverBId] ||
+                    getNormalizedLoad(serverBId, loadIndex.getLoad(serverBId)) > minLoad + loadConstraint) {
+                    return;
+                }
+                long long gain = calculateMoverGain(nodeId, Server::NodeType::PRIMARY, serverId, serverBId, loadDelta);
+                if (gain > maxGain || (gain == maxGain && gain != numeric_limits<long long>::min() &&
+                                       getNormalizedLoad(serverBId, loadIndex.getLoad(serverBId)) <
+                                       getNormalizedLoad(targetServerId, loadIndex.getLoad(targetServerId)))) {
+                    maxGain = gain;
+                    targetServerId = serverBId;
+                }
+            };
+            for (auto &p : neighborServers[nodeId]) {
+                tryServer(p.first);
+            }
+            tryServer(findLeastLoadedServer(nodeId));
+            // with a virtual primary on every server, SPAR (or moveNode) swaps it
+            // with the primary, and the virtual primary left is moved below
+            if (targetServerId < 0) {
+                targetServerId = findLeastLoadedServer();
+            }
+            applyMover(nodeId, Server::NodeType::PRIMARY, serverId, targetServerId);
+        }
+
+        // with no primary left, a virtual primary moved away leaves no copy behind
+        nodeIds.assign(servers[serverId]->getVirtualPrimaryNodes().begin(),
+                       servers[serverId]->getVirtualPrimaryNodes().end());
+        for (auto nodeId : nodeIds) {
+            if (virtualPrimaryNums[nodeId] > virtualPrimaryNum) {
+                servers[serverId]->removeNode(nodeId);
+                virtualPrimaryNums[nodeId]--;
+            } else {
+                moveVirtualPrimary(nodeId, serverId, findLeastLoadedServer(nodeId));
+            }
+        }
+        nodeIds = servers[serverId]->getNonPrimaryNodes();
+        for (auto nodeId : nodeIds) {
+            servers[serverId]->removeNode(nodeId);
+        }
+        assert(servers[serverId]->getNonPrimaryNum() == 0);
+        loadIndex.removeServer(serverId);
+
+        balanceLoads();
+        printMigration(reportMigration());
+        commitMoves();
+        printCostAndTime("remove server");
+    }
+
+    // add servers if serverDelta > 0, or remove the last ones if it is < 0
+    void resizeServers(int serverDelta) {
+        for (; serverDelta > 0; serverDelta--) {
+            addServer();
+        }
+        for (int serverId = (int) servers.size() - 1; serverDelta < 0 && serverId >= 0; serverId--) {
+            if (!removedServerMarks[serverId]) {
+                removeServer(serverId);
+                serverDelta++;
+            }
+        }
+    }
+
+    // copies a node from its primary server to a survivor in a recovery
+    void recoverCopy(int nodeId, int serverId, Server::NodeType type, FailureReport &report) {
+        servers[serverId]->addNode(nodeId, type);
+        if (type == Server::NodeType::VIRTUAL_PRIMARY) {
+            virtualPrimaryNums[nodeId]++;
+        }
+        recoveryNodes.emplace_back(nodeId);
+        ++recoveryTaskNums[primaryServerIds[nodeId]];
+        ++recoveryTaskNums[serverId];
+        ++report.copiedReplicas;
+        report.copiedBytes += nodeSizes[nodeId];
+    }
+
+    // Fails the servers inside the open transaction and recovers from the
+    // survivors. A lost primary is taken over by a surviving virtual primary, as
+    // moveNode swaps them, or by a non-primary copy if no virtual primary is
+    // left, on the server with the most weight to its neighbors; a node without
+    // any copy left is placed again. The locality of the new primaries is
+    // rebuilt, then the nodes get k virtual primaries again, turning a
+    // non-primary copy into one where there is one. Only the nodes which lost a
+    // copy are visited, and their k-availability and locality are verified.
+    FailureReport recoverFailure(const vector<int> &serverIds) {
+        FailureReport report;
+        failureNodes.clear();
+        recoveryNodes.clear();
+        recoveryTaskNums.assign(servers.size(), 0);
+        for (auto serverId : serverIds) {
+            removedServerMarks[serverId] = true;
+        }
+
+        // the removed servers are empty, so a copy on one of them is on a failed server
+        auto removeCopies = [&](int nodeId) {
+            bool lost = false;
+            for (size_t i = 0; i < replicas[nodeId].size();) {
+                auto replica = replicas[nodeId][i];
+                if (!removedServerMarks[replica.serverId]) {
+                    i++;
+                    continue;
+                }
+                // the last copy takes the place of the removed one
+                if (replica.type == Server::NodeType::VIRTUAL_PRIMARY) {
+                    virtualPrimaryNums[nodeId]--;
+                }
+                servers[replica.serverId]->removeNode(nodeId);
+                lost = true;
+            }
+            if (lost) {
+                failureNodes.emplace_back(nodeId);
+            }
+        };
+        // the nodes with a copy on a failed server, in id order
+        vector<int> nodeIds;
+        for (auto serverId : serverIds) {
+            auto server = servers[serverId].get();
+            nodeIds.insert(nodeIds.end(), server->getPrimaryNodes().begin(), server->getPrimaryNodes().end());
+            nodeIds.insert(nodeIds.end(), server->getVirtualPrimaryNodes().begin(),
+                           server->getVirtualPrimaryNodes().end());
+            nodeIds.insert(nodeIds.end(), server->getNonPrimaryNodes().begin(), server->getNonPrimaryNodes().end());
+        }
+        sort(nodeIds.begin(), nodeIds.end());
+        nodeIds.erase(unique(nodeIds.begin(), nodeIds.end()), nodeIds.end());
+        for (auto nodeId : nodeIds) {
+            removeCopies(nodeId);
+        }
+        for (auto serverId : serverIds) {
+            loadIndex.removeServer(serverId);
+        }
+
+        vector<int> promotedNodes;
+        for (auto nodeId : failureNodes) {
+            int serverAId = primaryServerIds[nodeId];
+            if (serverAId < 0 || !removedServerMarks[serverAId]) continue;
+            int serverBId = -1, maxWeight = -1;
+            bool virtualPrimary = false;
+            for (auto &replica : replicas[nodeId]) {
+                bool isVirtualPrimary = replica.type == Server::NodeType::VIRTUAL_PRIMARY;
+                if (virtualPrimary && !isVirtualPrimary) continue;
+                int weight = getNeighborServerWeight(nodeId, replica.serverId);
+                if (isVirtualPrimary != virtualPrimary || weight > maxWeight ||
+                    (weight == maxWeight && getNormalizedLoad(replica.serverId, loadIndex.getLoad(replica.serverId)) <
+                                            getNormalizedLoad(serverBId, loadIndex.getLoad(serverBId)))) {
+                    serverBId = replica.serverId;
+                    maxWeight = weight;
+                    virtualPrimary = isVirtualPrimary;
+                }
+            }
+            moveLog.emplace_back(MoveLogEntry{MoveLogEntry::Type::MOVE, nodeId, serverAId, Server::NodeType::PRIMARY, 0});
+            if (serverBId < 0) {
+                addNode(nodeId);
+                ++report.lostNodes;
+            } else {
+                servers[serverBId]->removeNode(nodeId);
+                servers[serverBId]->addNode(nodeId, Server::NodeType::PRIMARY);
+                if (virtualPrimary) {
+                    virtualPrimaryNums[nodeId]--;
+                }
+                primaryServerIds[nodeId] = serverBId;
+                ++recoveryTaskNums[serverBId];
+                ++report.promotedPrimaries;
+            }
+            promotedNodes.emplace_back(nodeId);
+        }
+
+        // SPAR keeps its copies for locality as virtual primaries
+        auto localityType = algorithm == Algorithm::SPAR ? Server::NodeType::VIRTUAL_PRIMARY
+                                                         : Server::NodeType::NON_PRIMARY;
+        for (auto nodeId : promotedNodes) {
+            int serverId = primaryServerIds[nodeId];
+            for (auto neighborId : getNeighbors(nodeId)) {
+                int neighborServerId = primaryServerIds[neighborId];
+                if (neighborServerId < 0) continue;
+                if (!getReplica(neighborId, serverId)) {
+                    recoverCopy(neighborId, serverId, localityType, report);
+                }
+                if (!getReplica(nodeId, neighborServerId)) {
+                    recoverCopy(nodeId, neighborServerId, localityType, report);
+                }
+            }
+        }
+
+        for (auto nodeId : failureNodes) {
+            while (primaryServerIds[nodeId] >= 0 && virtualPrimaryNums[nodeId] < virtualPrimaryNum) {
+                int serverId = -1;
+                for (auto &replica : replicas[nodeId]) {
+                    if (replica.type == Server::NodeType::NON_PRIMARY &&
+                        (serverId < 0 || getNormalizedLoad(replica.serverId, loadIndex.getLoad(replica.serverId)) <
+                                         getNormalizedLoad(serverId, loadIndex.getLoad(serverId)))) {
+                        serverId = replica.serverId;
+                    }
+                }
+                if (serverId >= 0) {
+                    servers[serverId]->removeNode(nodeId);
+                    servers[serverId]->addNode(nodeId, Server::NodeType::VIRTUAL_PRIMARY);
+                    virtualPrimaryNums[nodeId]++;
+                    ++recoveryTaskNums[serverId];
+                } else {
+                    recoverCopy(nodeId, findLeastLoadedServer(nodeId), Server::NodeType::VIRTUAL_PRIMARY, report);
+                }
+            }
+        }
+
+        for (auto nodeId : failureNodes) {
+            int serverId = primaryServerIds[nodeId];
+            if (serverId < 0) continue;
+            size_t virtualPrimaryCount = 0;
+            for (auto &replica : replicas[nodeId]) {
+                virtualPrimaryCount += (int) (replica.type == Server::NodeType::VIRTUAL_PRIMARY);
+            }
+            bool available = !removedServerMarks[serverId] && virtualPrimaryCount == virtualPrimaryNums[nodeId] &&
+                             virtualPrimaryCount >= virtualPrimaryNum;
+            for (auto neighborId : getNeighbors(nodeId)) {
+                int neighborServerId = primaryServerIds[neighborId];
+                if (neighborServerId >= 0 && (!getReplica(neighborId, serverId) || !getReplica(nodeId, neighborServerId))) {
+                    available = false;
+                }
+            }
+            if (!available) {
+                cerr << "recovery left node " << rawNodeIds[nodeId] << " without k copies or locality" << endl;
+                exit(-1);
+            }
+        }
+
+        double loadSum = 0, maxLoad = 0;
+        int survivorNum = 0;
+        for (int serverId = 0; serverId < servers.size(); serverId++) {
+            report.maxTaskNum = max(report.maxTaskNum, recoveryTaskNums[serverId]);
+            if (removedServerMarks[serverId]) continue;
+            double load = getNormalizedLoad(serverId, loadIndex.getLoad(serverId));
+            loadSum += load;
+            maxLoad = max(maxLoad, load);
+            ++survivorNum;
+        }
+        report.loadRatio = loadSum > 0 ? maxLoad / (loadSum / survivorNum) : 1;
+        return report;
+    }
+
+    // the servers must be distinct, not removed, and leave more than k survivors
+    void checkFailure(const vector<int> &serverIds) {
+        vector<bool> marks(servers.size(), false);
+        for (auto serverId : serverIds) {
+            if (serverId < 0 || serverId >= servers.size() || removedServerMarks[serverId] || marks[serverId]) {
+                cerr << "can not fail server " << serverId << endl;
+                exit(-1);
+            }
+            marks[serverId] = true;
+        }
+        if (count(removedServerMarks.begin(), removedServerMarks.end(), false) - serverIds.size() <=
+            virtualPrimaryNum) {
+            cerr << "failing " << serverIds.size() << " servers leaves at most k servers" << endl;
+            exit(-1);
+        }
+    }
+
+    // print a recovery as
+    //   failed servers,promoted primaries,lost nodes,copied replicas,copied bytes,recovery time,max/mean load,cost
+    // where the recovery time in microseconds is a network delay plus the tasks
+    // of the busiest server (each promotion, copy sent and copy received is one)
+    double printFailure(const vector<int> &serverIds, const FailureReport &report, double serviceTime,
+                        double networkDelay) {
+        double recoveryTime = report.maxTaskNum > 0 ? networkDelay + serviceTime * report.maxTaskNum : 0;
+        for (size_t i = 0; i < serverIds.size(); i++) {
+            cout << (i > 0 ? ";" : "") << serverIds[i];
+        }
+        cout << "," << report.promotedPrimaries << "," << report.lostNodes << "," << report.copiedReplicas << ","
+             << report.copiedBytes << "," << recoveryTime << "," << report.loadRatio << "," << interServerCost << endl;
+        return recoveryTime;
+    }
+
+    // Fails the servers together and keeps the recovered placement, the failed
+    // servers stay removed.
+    void failServers(const vector<int> &serverIds, double serviceTime, double networkDelay) {
+        checkFailure(serverIds);
+        beginMoves();
+        printFailure(serverIds, recoverFailure(serverIds), serviceTime, networkDelay);
+        commitMoves();
+        printCostAndTime("fail servers");
+    }
+
+    // Fails every server alone, printing each recovery, and undoes the recovery
+    // before the next one, so the placement is never copied; a summary goes to
+    // stderr.
+    void failEachServer(double serviceTime, double networkDelay) {
+        size_t caseNum = 0, lostNodes = 0;
+        double bytesSum = 0, maxBytes = 0, maxTime = 0, maxLoadRatio = 0;
+        for (int serverId = 0; serverId < servers.size(); serverId++) {
+            if (removedServerMarks[serverId]) continue;
+            vector<int> serverIds{serverId};
+            checkFailure(serverIds);
+            beginMoves();
+            auto report = recoverFailure(serverIds);
+            double recoveryTime = printFailure(serverIds, report, serviceTime, networkDelay);
+
+            // the server comes back before the copies it held are put back
+            loadIndex.restoreServer(serverId);
+            removedServerMarks[serverId] = false;
+            abortMoves(true);
+            // the undo log has no virtual primary counts, they are counted again
+            auto recount = [&](int nodeId) {
+                virtualPrimaryNums[nodeId] = 0;
+                for (auto &replica : replicas[nodeId]) {
+                    virtualPrimaryNums[nodeId] += (int) (replica.type == Server::NodeType::VIRTUAL_PRIMARY);
+                }
+            };
+            for (auto nodeId : failureNodes) {
+                recount(nodeId);
+            }
+            for (auto nodeId : recoveryNodes) {
+                recount(nodeId);
+            }
+
+            ++caseNum;
+            lostNodes += report.lostNodes;
+            bytesSum += report.copiedBytes;
+            maxBytes = max(maxBytes, report.copiedBytes);
+            maxTime = max(maxTime, recoveryTime);
+            maxLoadRatio = max(maxLoadRatio, report.loadRatio);
+        }
+        cerr << "failures: " << caseNum << " servers, " << lostNodes << " lost nodes, copied bytes mean "
+             << (caseNum > 0 ? bytesSum / caseNum : 0.0) << " max " << maxBytes << ", max recovery time " << maxTime
+             << ", max load ratio " << maxLoadRatio << endl;
+        // the placement is unchanged, so only the profile of the phase is written
+        PROFILE_END("fail each server", -1, computeInterServerCost());
+    }
+
+    // the dense id of a raw SNAP id, -1 if the node is not in the loaded graph
+    int getNodeId(int rawNodeId) const {
+        auto it = lower_bound(rawNodeIds.begin(), rawNodeIds.end(), rawNodeId);
+        return it != rawNodeIds.end() && *it == rawNodeId ? int(it - rawNodeIds.begin()) : -1;
+    }
+
+    bool hasEdge(int nodeAId, int nodeBId) const {
+        auto neighbors = getNeighbors(nodeAId);
+        return find(neighbors.begin(), neighbors.end(), nodeBId) != neighbors.end();
+    }
+
+    // the number of copies of all nodes, primaries included
+    size_t countReplicas() const {
+        size_t replicaNum = 0;
+        for (auto &server : servers) {
+            replicaNum += server->getPrimaryNodes().size() + server->getNonPrimaryNum();
+        }
+        return replicaNum;
+    }
+
+    // An edge of the trace is added the way the online algorithm adds it: SPAR
+    // evaluates its configurations, the others add the missing copies, and ONLINE
+    // then tries to reallocate both nodes as it does for a new node. The nodes of
+    // the edge are added first if they are not yet.
+    void replayAddEdge(int nodeAId, int nodeBId) {
+        for (auto nodeId : {nodeAId, nodeBId}) {
+            if (primaryServerIds[nodeId] < 0) {
+                addNode(nodeId);
+            }
+        }
+        addEdge(nodeAId, nodeBId);
+        if (algorithm == Algorithm::SPAR) {
+            addEdgeSPAR(nodeAId, nodeBId);
+            return;
+        }
+        ensureLocality(nodeAId, nodeBId);
+        if (algorithm == Algorithm::ONLINE) {
+            reallocateNode(nodeAId);
+            reallocateNode(nodeBId);
+        }
+    }
+
+    // a read of the node and its neighbors from the primary server of the node,
+    // returns the number of neighbors without a copy there
+    int replayRead(int nodeId) {
+        int serverId = primaryServerIds[nodeId];
+        int remoteNum = 0;
+        for (auto neighborId : getNeighbors(nodeId)) {
+            if (!getReplica(neighborId, serverId)) {
+                ++remoteNum;
+            }
+        }
+        return remoteNum;
+    }
+
+    // apply an operation of the trace, returns false if it does not apply to the
+    // current graph
+    bool replayOperation(const Trace::Operation &operation, size_t &remoteReadNum) {
+        int nodeAId = getNodeId(operation.nodeAId);
+        int nodeBId = operation.nodeBId >= 0 ? getNodeId(operation.nodeBId) : -1;
+        if (nodeAId < 0) return false;
+        bool nodeAAdded = primaryServerIds[nodeAId] >= 0;
+        switch (operation.type) {
+            case Trace::OperationType::ADD_NODE:
+                if (nodeAAdded) return false;
+                addNode(nodeAId);
+                return true;
+            case Trace::OperationType::ADD_EDGE: {
+                // the slots of the edges are those of the loaded graph
+                auto adjacencyA = getAdjacency(nodeAId);
+                if (nodeBId < 0 || !binary_search(adjacencyA.begin(), adjacencyA.end(), nodeBId) ||
+                    hasEdge(nodeAId, nodeBId)) {
+                    return false;
+                }
+                replayAddEdge(nodeAId, nodeBId);
+                return true;
+            }
+            case Trace::OperationType::REMOVE_EDGE:
+                if (nodeBId < 0 || !hasEdge(nodeAId, nodeBId)) return false;
+                removeEdge(nodeAId, nodeBId);
+                return true;
+            case Trace::OperationType::REMOVE_NODE:
+                if (!nodeAAdded) return false;
+                removeNode(nodeAId);
+                return true;
+            case Trace::OperationType::READ:
+                if (!nodeAAdded) return false;
+                remoteReadNum += replayRead(nodeAId);
+                return true;
+            case Trace::OperationType::WRITE:
+                // a write does not change the placement
+                return nodeAAdded;
+        }
+        return false;
+    }
+
+    // print a window of the replay as
+    //   window start,operations,cost,replicas,p50,p99,p999
+    // with the latencies of the operations in microseconds
+    void printReplayWindow(long long windowStart, vector<double> &latencies) {
+        auto percentile = [&](double p) {
+            if (latencies.empty()) return 0.0;
+            size_t rank = (size_t) ceil(p * latencies.size()) - 1;
+            nth_element(latencies.begin(), latencies.begin() + rank, latencies.end());
+            return latencies[rank];
+        };
+        double p50 = percentile(0.5), p99 = percentile(0.99), p999 = percentile(0.999);
+        cout << windowStart << "," << latencies.size() << "," << computeInterServerCost() << ","
+             << countReplicas() << "," << p50 << "," << p99 << "," << p999 << endl;
+        latencies.clear();
+    }
+
+    // Replays the trace from an empty placement with the online algorithm, and
+    // prints a line every window of window timestamps (one line for the whole
+    // trace if window <= 0). The nodes and edges of the trace must be in the
+    // loaded graph, the others are skipped.
+    void replay(const Trace &trace, long long window) {
+        if (algorithm != Algorithm::RANDOM && algorithm != Algorithm::SPAR && algorithm != Algorithm::ONLINE) {
+            cerr << "only random, spar and online can replay a trace" << endl;
+            exit(-1);
+        }
+        if (algorithm == Algorithm::SPAR) {
+            initSPAR();
+        }
+
+        start = chrono::system_clock::now();
+        auto &operations = trace.getOperations();
+        vector<double> latencies;
+        size_t skippedNum = 0, remoteReadNum = 0;
+        long long windowStart = operations.empty() ? 0 : operations.front().timestamp;
+        for (auto &operation : operations) {
+            if (window > 0 && operation.timestamp >= windowStart + window) {
+                if (!latencies.empty()) {
+                    printReplayWindow(windowStart, latencies);
+                }
+                windowStart += (operation.timestamp - windowStart) / window * window;
+            }
+            auto operationStart = chrono::steady_clock::now();
+            bool applied = replayOperation(operation, remoteReadNum);
+            auto operationEnd = chrono::steady_clock::now();
+            if (applied) {
+                latencies.emplace_back(chrono::duration<double, micro>(operationEnd - operationStart).count());
+            } else {
+                ++skippedNum;
+            }
+        }
+        if (!latencies.empty()) {
+            printReplayWindow(windowStart, latencies);
+        }
+        cerr << "replay: " << operations.size() - skippedNum << " operations, " << skippedNum << " skipped, "
+             << remoteReadNum << " remote reads" << endl;
+        printCostAndTime("replay");
     }
 
     void run() {
         start = chrono::system_clock::now();
+        PROFILE_BEGIN();
         switch (algorithm) {
             case Algorithm::RANDOM:
                 runProposed(true);
@@ -5,7 +5,6 @@
 #ifndef SOCIAL_NETWORK_MERGEDGRAPH_H
 #define SOCIAL_NETWORK_MERGEDGRAPH_H
 
-#include <Snap.h>
 #include <vector>
 #include <set>
 #include <random>
@@ -15,142 +14,226 @@
 
 using namespace std;
 
+// Coarsens the primaries of one server by contracting an edge whenever it raises
+// beta = (internal - external) / size of the group. The nodes are kept in local
+// indices, and an edge a -> b is stored in the out list of a (with its weight) and
+// in the in list of b, both sorted, so the neighbors of a node are enumerated as
+// its out list followed by its in list. The storage is an arena which is reset
+// and reused by every server.
 class MergedGraph {
 public:
-    struct Node {
-        vector<int> nodeIds;
-//        bool processed = false;
-//        int primaryServerId = -1;
-//        int groupId = -1;
-        int internalNum = 0;
-        int externalNum = 0;
-
-        void Save(TSOut &SOut) const {}
+    struct Edge {
+        int node;
+        int weight;
     };
 
-    typedef TNodeEDatNet<Node, TInt> Graph;
-    typedef Graph::TNode GraphNode;
+    // a coarsened group, members sorted by id
+    struct Group {
+        vector<int> nodeIds;
+    };
 
 private:
-    TPt<Graph> graph;
+    // local index -> node id, nodes must be added in ascending id order
     vector<int> nodeIds;
-    int primaryServerId;
+    // node id -> local index, -1 if the node is not on the server
+    vector<int> localIds;
+    // union-find over the groups, a group is alive if it is its own parent
+    vector<int> parents;
+    // members of a group as a linked list of local indices, spliced on contraction
+    vector<int> nextMembers, lastMembers;
+    vector<int> memberNums;
+    vector<int> internalNums, externalNums;
+    vector<vector<Edge> > outEdges;
+    vector<vector<int> > inEdges;
+    size_t nodeNum = 0;
+
+    // scratch buffers
+    vector<int> order, neighbors, members;
+    vector<Edge> newEdges;
+
+    static vector<Edge>::iterator findOutEdge(vector<Edge> &edges, int node) {
+        auto it = lower_bound(edges.begin(), edges.end(), node,
+                              [](const Edge &edge, int node) { return edge.node < node; });
+        return it != edges.end() && it->node == node ? it : edges.end();
+    }
 
-public:
-    MergedGraph(int primaryServerId) : primaryServerId(primaryServerId) {
-        graph = Graph::New();
+    // the weight of the edge between a and b in either direction, nullptr if none
+    int *findEdge(int a, int b) {
+        auto it = findOutEdge(outEdges[a], b);
+        if (it != outEdges[a].end()) return &it->weight;
+        it = findOutEdge(outEdges[b], a);
+        if (it != outEdges[b].end()) return &it->weight;
+        return nullptr;
     }
 
-    void addNode(int nodeId) {
-        Node nodeData = {
-                .nodeIds = {nodeId},
-//                .primaryServerId = primaryServerId,
-//                .groupId = nodeId,
-        };
-        graph->AddNode(nodeId, nodeData);
-        nodeIds.emplace_back(nodeId);
+    void addDirectedEdge(int a, int b, int weight) {
+        auto &edges = outEdges[a];
+        edges.insert(lower_bound(edges.begin(), edges.end(), b,
+                                 [](const Edge &edge, int node) { return edge.node < node; }), Edge{b, weight});
+        auto &in = inEdges[b];
+        in.insert(lower_bound(in.begin(), in.end(), a), a);
     }
 
-    GraphNode &getNode(int nodeId) {
-        const Graph *g = graph();
-        const auto &node = g->GetNode(nodeId);
-        return const_cast<GraphNode &>(node);
+    int find(int node) {
+        while (parents[node] != node) {
+            node = parents[node] = parents[parents[node]];
+        }
+        return node;
+    }
+
+    // move the edges of group b to group a and remove b
+    void contract(int a, int b) {
+        newEdges.clear();
+        auto visit = [&](int node, int weight) {
+            if (node == a) return;
+            if (auto edge = findEdge(a, node)) {
+                *edge += weight;
+            } else {
+                newEdges.push_back(Edge{node, weight});
+            }
+        };
+        for (auto &edge : outEdges[b]) {
+            visit(edge.node, edge.weight);
+        }
+        for (auto node : inEdges[b]) {
+            visit(node, findOutEdge(outEdges[node], b)->weight);
+        }
+
+        for (auto &edge : outEdges[b]) {
+            auto &in = inEdges[edge.node];
+            in.erase(lower_bound(in.begin(), in.end(), b));
+        }
+        for (auto node : inEdges[b]) {
+            outEdges[node].erase(findOutEdge(outEdges[node], b));
+        }
+        outEdges[b].clear();
+        inEdges[b].clear();
+
+        // the new out edges of a are merged in place from the back
+        sort(newEdges.begin(), newEdges.end(), [](const Edge &x, const Edge &y) { return x.node < y.node; });
+        auto &edges = outEdges[a];
+        auto oldSize = edges.size();
+        edges.resize(oldSize + newEdges.size());
+        auto dst = edges.end(), src = edges.begin() + oldSize, newSrc = newEdges.end();
+        while (newSrc != newEdges.begin()) {
+            if (src != edges.begin() && (src - 1)->node > (newSrc - 1)->node) {
+                *--dst = *--src;
+            } else {
+                *--dst = *--newSrc;
+            }
+        }
+        for (auto &edge : newEdges) {
+            auto &in = inEdges[edge.node];
+            in.insert(lower_bound(in.begin(), in.end(), a), a);
+        }
+
+        parents[b] = a;
+        nextMembers[lastMembers[a]] = b;
+        lastMembers[a] = lastMembers[b];
+        memberNums[a] += memberNums[b];
     }
 
-    bool isEdge(int nodeAId, int nodeBId) {
-        return graph->IsEdge(nodeAId, nodeBId) || graph->IsEdge(nodeBId, nodeAId);
+public:
+    void reset() {
+        for (auto nodeId : nodeIds) {
+            localIds[nodeId] = -1;
+        }
+        nodeIds.clear();
+        nodeNum = 0;
     }
 
-    void addEdge(int nodeAId, int nodeBId, int weight = 1) {
-        if (graph->IsNode(nodeAId) && graph->IsNode(nodeBId) && !isEdge(nodeAId, nodeBId)) {
-            graph->AddEdge(nodeAId, nodeBId, weight);
-            getNode(nodeAId).GetDat().externalNum += weight;
-            getNode(nodeBId).GetDat().externalNum += weight;
+    void addNode(int nodeId) {
+        assert(nodeIds.empty() || nodeIds.back() < nodeId);
+        if (nodeId >= localIds.size()) {
+            localIds.resize(nodeId + 1, -1);
+        }
+        int node = nodeNum++;
+        if (nodeNum > parents.size()) {
+            parents.resize(nodeNum);
+            nextMembers.resize(nodeNum);
+            lastMembers.resize(nodeNum);
+            memberNums.resize(nodeNum);
+            internalNums.resize(nodeNum);
+            externalNums.resize(nodeNum);
+            outEdges.resize(nodeNum);
+            inEdges.resize(nodeNum);
         }
+        localIds[nodeId] = node;
+        nodeIds.emplace_back(nodeId);
+        parents[node] = node;
+        nextMembers[node] = -1;
+        lastMembers[node] = node;
+        memberNums[node] = 1;
+        internalNums[node] = 0;
+        externalNums[node] = 0;
+        outEdges[node].clear();
+        inEdges[node].clear();
     }
 
-    TInt &getEdge(int nodeAId, int nodeBId) {
-        if (graph->IsEdge(nodeAId, nodeBId)) {
-            return graph->GetEDat(nodeAId, nodeBId);
-        } else {
-            return graph->GetEDat(nodeBId, nodeAId);
+    void addEdge(int nodeAId, int nodeBId, int weight = 1) {
+        if (nodeAId >= localIds.size() || nodeBId >= localIds.size()) return;
+        int a = localIds[nodeAId], b = localIds[nodeBId];
+        if (a >= 0 && b >= 0 && !findEdge(a, b)) {
+            addDirectedEdge(a, b, weight);
+            externalNums[a] += weight;
+            externalNums[b] += weight;
         }
-        assert(0);
     }
 
     void merge(mt19937 &generator) {
-//        cout << "server " << primaryServerId << ": ";
-//        for (auto nodeId : nodeIds) {
-//            cout << nodeId << " ";
-//        }
-//        cout << endl;
-        shuffle(nodeIds.begin(), nodeIds.end(), generator);
-        vector<int> neighborIds;
-        for (auto nodeId : nodeIds) {
-            if (!graph->IsNode(nodeId)) continue;
-            auto &node = getNode(nodeId);
-            auto &nodeData = node.GetDat();
+        order.resize(nodeNum);
+        for (size_t i = 0; i < nodeNum; i++) {
+            order[i] = i;
+        }
+        shuffle(order.begin(), order.end(), generator);
+        for (auto node : order) {
+            if (find(node) != node) continue;
 
             // get all neighbors
-            neighborIds.clear();
-            auto neighborNum = node.GetDeg();
-            for (int i = 0; i < neighborNum; i++) {
-                auto neighborId = node.GetNbrNId(i);
-                neighborIds.emplace_back(neighborId);
+            neighbors.clear();
+            for (auto &edge : outEdges[node]) {
+                neighbors.emplace_back(edge.node);
             }
-            shuffle(neighborIds.begin(), neighborIds.end(), generator);
+            neighbors.insert(neighbors.end(), inEdges[node].begin(), inEdges[node].end());
+            shuffle(neighbors.begin(), neighbors.end(), generator);
 
-            for (auto neighborId : neighborIds) {
-                auto &neighbor = getNode(neighborId);
-                auto &neighborData = neighbor.GetDat();
-                double beta = (nodeData.internalNum - nodeData.externalNum) / (double) nodeData.nodeIds.size();
+            for (auto neighbor : neighbors) {
+                double beta = (internalNums[node] - externalNums[node]) / (double) memberNums[node];
 
-                int sharedNum = getEdge(nodeId, neighborId);
-                int newInternalNum = nodeData.internalNum + neighborData.internalNum + sharedNum;
-                int newExternalNum = nodeData.externalNum + neighborData.externalNum - 2 * sharedNum;
+                int sharedNum = *findEdge(node, neighbor);
+                int newInternalNum = internalNums[node] + internalNums[neighbor] + sharedNum;
+                int newExternalNum = externalNums[node] + externalNums[neighbor] - 2 * sharedNum;
 
                 double newBeta = (newInternalNum - newExternalNum) /
-                                 (double) (nodeData.nodeIds.size() + neighborData.nodeIds.size());
+                                 (double) (memberNums[node] + memberNums[neighbor]);
                 if (newBeta > beta) {
-                    nodeData.internalNum = newInternalNum;
-                    nodeData.externalNum = newExternalNum;
-                    vector<int> temp;
-                    std::merge(nodeData.nodeIds.begin(), nodeData.nodeIds.end(),
-                               neighborData.nodeIds.begin(), neighborData.nodeIds.end(),
-                               back_inserter(temp));
-                    nodeData.nodeIds.swap(temp);
-                    int neighborNeighborNum = neighbor.GetDeg();
-                    for (int i = 0; i < neighborNeighborNum; i++) {
-                        auto neighborNeighborId = neighbor.GetNbrNId(i);
-                        if (neighborNeighborId != nodeId) {
-                            int weight = getEdge(neighborId, neighborNeighborId);
-                            if (!isEdge(nodeId, neighborNeighborId)) {
-                                graph->AddEdge(nodeId, neighborNeighborId, weight);
-                            } else {
-                                getEdge(nodeId, neighborNeighborId) += weight;
-                            }
-                        }
-                    }
-                    graph->DelNode(neighborId);
+                    internalNums[node] = newInternalNum;
+                    externalNums[node] = newExternalNum;
+                    contract(node, neighbor);
                 }
             }
         }
     }
 
-    void finalize(set<int> &singleNodes, vector<vector<int> > &groupedNodes) {
-        for (auto node = graph->BegNI(); node != graph->EndNI(); node++) {
-//            cout << "(";
-            if (node.GetDat().nodeIds.size() == 1) {
-                singleNodes.emplace(node.GetDat().nodeIds[0]);
+    void finalize(set<int> &singleNodes, vector<Group> &groupedNodes) {
+        for (size_t node = 0; node < nodeNum; node++) {
+            if (parents[node] != node) continue;
+            if (memberNums[node] == 1) {
+                singleNodes.emplace(nodeIds[node]);
+            }
+            // local indices follow the node ids, so the sorted members are sorted ids
+            members.clear();
+            for (int member = node; member >= 0; member = nextMembers[member]) {
+                members.emplace_back(member);
+            }
+            sort(members.begin(), members.end());
+            groupedNodes.emplace_back();
+            auto &group = groupedNodes.back();
+            group.nodeIds.reserve(members.size());
+            for (auto member : members) {
+                group.nodeIds.emplace_back(nodeIds[member]);
             }
-            groupedNodes.emplace_back(node.GetDat().nodeIds);
-
-//            for (auto nodeId : node.GetDat().nodeIds) {
-//                cout << nodeId << " ";
-//            }
-//            cout << ") ";
         }
-//        cout << endl;
     }
 
 };
@@ -0,0 +1,107 @@
+#ifndef SOCIAL_NETWORK_PROFILER_H
+#define SOCIAL_NETWORK_PROFILER_H
+
+#ifdef PROFILE
+
+#include <chrono>
+#include <ctime>
+#include <iostream>
+#include <sys/resource.h>
+
+using namespace std;
+
+// Counters and timers of a placement phase, written to stderr as one JSON line
+// when the phase ends, next to the cost and time line on stdout. It is compiled
+// in with -DPROFILE=ON only, otherwise the PROFILE_* macros are empty.
+class Profiler {
+public:
+    struct Timer {
+        double wallTime = 0;
+        double cpuTime = 0;
+        long long calls = 0;
+    };
+
+    class ScopedTimer {
+    private:
+        Timer &timer;
+        chrono::steady_clock::time_point wallStart;
+        clock_t cpuStart;
+
+    public:
+        explicit ScopedTimer(Timer &timer)
+                : timer(timer), wallStart(chrono::steady_clock::now()), cpuStart(clock()) {}
+
+        ~ScopedTimer() {
+            timer.wallTime += chrono::duration<double>(chrono::steady_clock::now() - wallStart).count();
+            timer.cpuTime += (double) (clock() - cpuStart) / CLOCKS_PER_SEC;
+            ++timer.calls;
+        }
+    };
+
+    // every moveNode call, and the moves among them undone by aborting a transaction;
+    // the primaries put back after each failure of -i all are counted apart, as no
+    // move was rejected there
+    long long moves = 0;
+    long long movesReverted = 0;
+    long long movesRestored = 0;
+    long long findMaxSCBCalls = 0;
+    long long replicaAdds = 0;
+    long long replicaRemoves = 0;
+    // tryReBalance runs inside mergeNodes, so it is timed on its own
+    Timer reBalance;
+
+private:
+    chrono::steady_clock::time_point wallStart;
+    clock_t cpuStart = 0;
+
+public:
+    void beginPhase() {
+        moves = movesReverted = movesRestored = findMaxSCBCalls = replicaAdds = replicaRemoves = 0;
+        reBalance = Timer();
+        wallStart = chrono::steady_clock::now();
+        cpuStart = clock();
+    }
+
+    void endPhase(const char *phase, int iteration, long long cost) {
+        double wallTime = chrono::duration<double>(chrono::steady_clock::now() - wallStart).count();
+        double cpuTime = (double) (clock() - cpuStart) / CLOCKS_PER_SEC;
+        struct rusage usage{};
+        getrusage(RUSAGE_SELF, &usage);
+
+        cerr << "{\"phase\":\"" << phase << "\",\"iteration\":";
+        if (iteration >= 0) cerr << iteration; else cerr << "null";
+        cerr << ",\"cost\":" << cost
+             << ",\"wallTime\":" << wallTime
+             << ",\"cpuTime\":" << cpuTime
+             << ",\"movesAttempted\":" << moves
+             << ",\"movesApplied\":" << moves - movesReverted
+             << ",\"movesReverted\":" << movesReverted
+             << ",\"movesRestored\":" << movesRestored
+             << ",\"findMaxSCBCalls\":" << findMaxSCBCalls
+             << ",\"replicaAdds\":" << replicaAdds
+             << ",\"replicaRemoves\":" << replicaRemoves
+             << ",\"reBalanceCalls\":" << reBalance.calls
+             << ",\"reBalanceWallTime\":" << reBalance.wallTime
+             << ",\"reBalanceCpuTime\":" << reBalance.cpuTime
+             << ",\"peakRSSKB\":" << usage.ru_maxrss
+             << "}" << endl;
+        beginPhase();
+    }
+};
+
+#define PROFILE_BEGIN() profiler.beginPhase()
+#define PROFILE_END(phase, iteration, cost) profiler.endPhase(phase, iteration, cost)
+#define PROFILE_COUNT(counter, n) (profiler.counter += (n))
+#define PROFILE_SCOPE(timer) Profiler::ScopedTimer timer##ScopedTimer(profiler.timer)
+
+#else
+
+#define PROFILE_BEGIN() ((void) 0)
+#define PROFILE_END(phase, iteration, cost) ((void) 0)
+#define PROFILE_COUNT(counter, n) ((void) 0)
+#define PROFILE_SCOPE(timer) ((void) 0)
+
+#endif
+
+
+#endif //SOCIAL_NETWORK_PROFILER_H
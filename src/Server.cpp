@@ -24,28 +24,37 @@ void Server::addNode(int nodeId, NodeType type) {
         } else {
             virtualPrimaryNodes.emplace(nodeId);
         }
-        manager->removeServerFromSet(this);
         ++load;
-        manager->addServerToSet(this);
+        manager->updateServerLoad(this);
+    }
+    if (type != NodeType::PRIMARY) {
+        ++nonPrimaryNum;
+        nonPrimaryTraffic += manager->getUpdateTraffic(nodeId);
+        manager->updateInterServerCost(manager->getUpdateTraffic(nodeId));
+    }
+    manager->addReplica(nodeId, Replica{id, type});
+    if (type == NodeType::NON_PRIMARY) {
+        nonPrimaryNodes.emplace_back(nodeId);
+        if (nonPrimaryNodes.size() > 2 * (size_t) nonPrimaryNum + 64) {
+            compactNonPrimaryNodes();
+        }
     }
-    graph->AddNode(nodeId, Node{type});
 }
 
-Server::Node &Server::getNode(int nodeId) {
-    return graph->GetNDat(nodeId);
+Server::Replica &Server::getNode(int nodeId) {
+    auto replica = manager->getReplica(nodeId, id);
+    assert(replica);
+    return *replica;
 }
 
-void Server::mergeNodes(mt19937 &generator) {
-    MergedGraph mergedGraph(id);
+void Server::mergeNodes(MergedGraph &mergedGraph, mt19937 &generator) {
+    mergedGraph.reset();
     for (auto nodeId : primaryNodes) {
         mergedGraph.addNode(nodeId);
     }
     for (auto nodeId : primaryNodes) {
-        auto &node = manager->getNode(nodeId);
-        auto neighborNum = node.GetDeg();
-        for (int i = 0; i < neighborNum; i++) {
-            auto neighborId = node.GetNbrNId(i);
-            mergedGraph.addEdge(nodeId, neighborId);
+        for (auto neighborId : manager->getNeighbors(nodeId)) {
+            mergedGraph.addEdge(nodeId, neighborId, manager->getEdgeWeight(nodeId, neighborId));
         }
     }
     mergedGraph.merge(generator);
@@ -54,25 +63,29 @@ void Server::mergeNodes(mt19937 &generator) {
 
 
 void Server::removeNode(int nodeId) {
-    auto &node = getNode(nodeId);
+    auto type = getNode(nodeId).type;
 #ifndef NDEBUG
-//        cout << "server " << id << ": remove node " << nodeId << " (" << NodeTypeString[(int) node.type] << ")" << endl;
+//        cout << "server " << id << ": remove node " << nodeId << " (" << NodeTypeString[(int) type] << ")" << endl;
 #endif
-    if (node.type == NodeType::PRIMARY || node.type == NodeType::VIRTUAL_PRIMARY) {
-        if (node.type == NodeType::PRIMARY) {
+    if (type == NodeType::PRIMARY || type == NodeType::VIRTUAL_PRIMARY) {
+        if (type == NodeType::PRIMARY) {
             primaryNodes.erase(nodeId);
         } else {
             virtualPrimaryNodes.erase(nodeId);
         }
-        manager->removeServerFromSet(this);
         --load;
-        manager->addServerToSet(this);
+        manager->updateServerLoad(this);
+    }
+    if (type != NodeType::PRIMARY) {
+        --nonPrimaryNum;
+        nonPrimaryTraffic -= manager->getUpdateTraffic(nodeId);
+        manager->updateInterServerCost(-manager->getUpdateTraffic(nodeId));
     }
-    graph->DelNode(nodeId);
+    manager->removeReplica(nodeId, id);
 }
 
 bool Server::hasNode(int nodeId) const {
-    return graph->IsNode(nodeId);
+    return manager->getReplica(nodeId, id) != nullptr;
 }
 
 int Server::getLoad() const {
@@ -91,28 +104,32 @@ const set<int> &Server::getVirtualPrimaryNodes() const {
     return virtualPrimaryNodes;
 }
 
-int Server::computeInterServerCost() const {
-    return graph->GetNodes() - (int) primaryNodes.size();
+int Server::getNonPrimaryNum() const {
+    return nonPrimaryNum;
+}
+
+const vector<int> &Server::getNonPrimaryNodes() {
+    compactNonPrimaryNodes();
+    return nonPrimaryNodes;
+}
+
+void Server::compactNonPrimaryNodes() {
+    sort(nonPrimaryNodes.begin(), nonPrimaryNodes.end());
+    nonPrimaryNodes.erase(unique(nonPrimaryNodes.begin(), nonPrimaryNodes.end()), nonPrimaryNodes.end());
+    nonPrimaryNodes.erase(remove_if(nonPrimaryNodes.begin(), nonPrimaryNodes.end(), [&](int nodeId) {
+        return !manager->isReplicaType(nodeId, id, NodeType::NON_PRIMARY);
+    }), nonPrimaryNodes.end());
+}
+
+long long Server::computeInterServerCost() const {
+    return nonPrimaryTraffic;
 }
 
 void Server::validate() {
-    for (auto node = graph->BegNI(); node != graph->EndNI(); node++) {
-        auto neighborNum = node.GetDeg();
-        for (int i = 0; i < neighborNum; i++) {
-            auto neighborId = node.GetNbrNId(i);
-            const auto &neighbor = ((const TNodeNet<Node> *) graph())->GetNode(neighborId);
-            bool flag = false;
-            if (neighbor.GetDat().type == NodeType::NON_PRIMARY) {
-                auto neighborNeighborNum = neighbor.GetDeg();
-                for (int j = 0; j < neighborNeighborNum; j++) {
-                    auto neighborNeighborId = neighbor.GetNbrNId(j);
-                    if (graph->GetNDat(neighborNeighborId).type == NodeType::PRIMARY) {
-                        flag = true;
-                        break;
-                    }
-                }
-            }
-            if (!flag) {
+    // every added neighbor of a primary node must have a copy on the server
+    for (auto nodeId : primaryNodes) {
+        for (auto neighborId : manager->getNeighbors(nodeId)) {
+            if (manager->getPrimaryServerId(neighborId) >= 0 && !hasNode(neighborId)) {
                 cout << "validation failed" << endl;
                 exit(-1);
             }
@@ -124,6 +141,6 @@ set<int> &Server::getSingleNodes() {
     return singleNodes;
 }
 
-vector<vector<int> > &Server::getGroupedNodes() {
+vector<MergedGraph::Group> &Server::getGroupedNodes() {
     return groupedNodes;
 }
@@ -5,6 +5,7 @@
 #ifndef SOCIAL_NETWORK_SERVER_H
 #define SOCIAL_NETWORK_SERVER_H
 
+#include "MergedGraph.h"
 #include <Snap.h>
 #include <set>
 #include <random>
@@ -23,41 +24,34 @@ public:
 
     const static char *NodeTypeString[3];
 
-    struct Node {
+    // a copy of a node held by a server, stored in the node's replica list on the Manager
+    struct Replica {
+        int serverId;
         NodeType type;
-
-        void Save(TSOut& SOut) const {
-            TInt temp((int) type);
-            temp.Save(SOut);
-        }
     };
 
 private:
-    TPt<TNodeNet<Node> > graph;
     set<int> primaryNodes, virtualPrimaryNodes;
+    // the nodes given a NON_PRIMARY copy, appended on every add; a copy removed
+    // since stays until the list is compacted, so it may hold stale and repeated ids
+    vector<int> nonPrimaryNodes;
     int id;
     int load = 0;
+    int nonPrimaryNum = 0;
+    // the update traffic of the non-primary copies
+    long long nonPrimaryTraffic = 0;
     Manager *manager;
     set<int> singleNodes;
-    vector<vector<int> > groupedNodes;
+    vector<MergedGraph::Group> groupedNodes;
 
 public:
-    struct Compare {
-        bool operator()(const Server *a, const Server *b) const {
-            if (a->load != b->load) return a->load < b->load;
-            return a->id < b->id;
-        }
-    };
-
-    Server(int id, Manager *manager) : id(id), manager(manager) {
-        graph = TNodeNet<Node>::New();
-    }
+    Server(int id, Manager *manager) : id(id), manager(manager) {}
 
     void addNode(int nodeId, NodeType type);
 
-    Node &getNode(int nodeId);
+    Replica &getNode(int nodeId);
 
-    void mergeNodes(mt19937 &generator);
+    void mergeNodes(MergedGraph &mergedGraph, mt19937 &generator);
 
     void removeNode(int nodeId);
 
@@ -71,13 +65,20 @@ public:
 
     const set<int> & getVirtualPrimaryNodes() const;
 
-    int computeInterServerCost() const;
+    int getNonPrimaryNum() const;
+
+    // compacts the list, and returns the nodes of the NON_PRIMARY copies in id order
+    const vector<int> & getNonPrimaryNodes();
+
+    void compactNonPrimaryNodes();
+
+    long long computeInterServerCost() const;
 
     void validate();
 
     set<int> &getSingleNodes();
 
-    vector<vector<int> > &getGroupedNodes();
+    vector<MergedGraph::Group> &getGroupedNodes();
 };
 
 
@@ -0,0 +1,162 @@
+#include "Simulator.h"
+#include "Manager.h"
+
+#include <queue>
+#include <algorithm>
+#include <iostream>
+#include <cmath>
+#include <cassert>
+
+Simulator::Simulator(const Manager &manager, const Config &config)
+        : manager(manager), config(config), generator(config.seed) {}
+
+bool Simulator::hasCopy(int nodeId, int serverId) const {
+    for (auto &replica : manager.getReplicas(nodeId)) {
+        if (replica.serverId == serverId) return true;
+    }
+    return false;
+}
+
+void Simulator::generate(size_t requestNum) {
+    vector<int> nodeIds;
+    for (size_t nodeId = 0; nodeId < manager.getNodeNum(); nodeId++) {
+        if (manager.getPrimaryServerId(nodeId) >= 0) {
+            nodeIds.emplace_back(nodeId);
+        }
+    }
+    if (nodeIds.empty()) {
+        cerr << "no placed node to simulate" << endl;
+        exit(-1);
+    }
+
+    exponential_distribution<double> interval(config.rate / 1e6);
+    uniform_int_distribution<size_t> user(0, nodeIds.size() - 1);
+    bernoulli_distribution read(config.readRatio);
+    requests.clear();
+    double time = 0;
+    for (size_t i = 0; i < requestNum; i++) {
+        bool write = !read(generator);
+        requests.emplace_back(Request{time, write, nodeIds[user(generator)]});
+        time += interval(generator);
+    }
+}
+
+void Simulator::load(const Trace &trace) {
+    requests.clear();
+    // the time starts at the first request kept, not at a skipped operation before it
+    long long startTimestamp = 0;
+    for (auto &operation : trace.getOperations()) {
+        if (operation.type != Trace::OperationType::READ && operation.type != Trace::OperationType::WRITE) {
+            continue;
+        }
+        int nodeId = manager.getNodeId(operation.nodeAId);
+        if (nodeId < 0 || manager.getPrimaryServerId(nodeId) < 0) continue;
+        if (requests.empty()) {
+            startTimestamp = operation.timestamp;
+        }
+        requests.emplace_back(Request{(double) (operation.timestamp - startTimestamp),
+                                      operation.type == Trace::OperationType::WRITE, nodeId});
+    }
+}
+
+void Simulator::run() {
+    size_t serverNum = manager.getServerNum();
+    vector<double> freeTimes(serverNum, 0), busyTimes(serverNum, 0);
+    // the time the last answer of a request arrives, and the answers it waits for
+    vector<double> completions(requests.size(), 0);
+    vector<int> pendingNums(requests.size(), 0);
+    vector<int> fanOuts(requests.size(), 0);
+    // the servers of the fan-out of the current read, marked with its id
+    vector<int> serverMarks(serverNum, -1);
+
+    priority_queue<Task, vector<Task>, greater<> > tasks;
+    size_t sequence = 0;
+    for (size_t requestId = 0; requestId < requests.size(); requestId++) {
+        auto &request = requests[requestId];
+        tasks.push(Task{request.arrival, sequence++, manager.getPrimaryServerId(request.nodeId), (int) requestId,
+                        true});
+    }
+
+    // each task is served when the server is free, in the order the tasks arrive
+    while (!tasks.empty()) {
+        auto task = tasks.top();
+        tasks.pop();
+        double finish = max(task.arrival, freeTimes[task.serverId]) + config.serviceTime;
+        freeTimes[task.serverId] = finish;
+        busyTimes[task.serverId] += config.serviceTime;
+
+        if (!task.primary) {
+            // the answer goes back to the primary server
+            completions[task.requestId] = max(completions[task.requestId], finish + config.networkDelay);
+            --pendingNums[task.requestId];
+            continue;
+        }
+
+        auto &request = requests[task.requestId];
+        auto send = [&](int serverId) {
+            tasks.push(Task{finish + config.networkDelay, sequence++, serverId, task.requestId, false});
+            ++fanOuts[task.requestId];
+        };
+        if (request.write) {
+            for (auto &replica : manager.getReplicas(request.nodeId)) {
+                if (replica.serverId != task.serverId) {
+                    send(replica.serverId);
+                }
+            }
+        } else {
+            for (auto neighborId : manager.getNeighbors(request.nodeId)) {
+                int serverId = manager.getPrimaryServerId(neighborId);
+                if (serverId < 0 || hasCopy(neighborId, task.serverId) || serverMarks[serverId] == task.requestId) {
+                    continue;
+                }
+                serverMarks[serverId] = task.requestId;
+                send(serverId);
+            }
+        }
+        completions[task.requestId] = finish;
+        pendingNums[task.requestId] = fanOuts[task.requestId];
+    }
+
+    double firstArrival = requests.empty() ? 0 : requests.front().arrival, lastCompletion = firstArrival;
+    for (auto completion : completions) {
+        lastCompletion = max(lastCompletion, completion);
+    }
+    double span = max(lastCompletion - firstArrival, config.serviceTime);
+    double busyTime = 0, maxBusyTime = 0;
+    int busyServerNum = 0;
+    for (auto time : busyTimes) {
+        if (time > 0) {
+            busyTime += time;
+            maxBusyTime = max(maxBusyTime, time);
+            ++busyServerNum;
+        }
+    }
+    cout << requests.size() << "," << requests.size() / span * 1e6 << ","
+         << (busyServerNum > 0 ? busyTime / busyServerNum / span : 0.0) << "," << maxBusyTime / span << endl;
+
+    auto percentile = [](vector<double> &values, double p) {
+        if (values.empty()) return 0.0;
+        size_t rank = (size_t) ceil(p * values.size()) - 1;
+        nth_element(values.begin(), values.begin() + rank, values.end());
+        return values[rank];
+    };
+    for (bool write : {false, true}) {
+        vector<double> latencies, requestFanOuts;
+        for (size_t requestId = 0; requestId < requests.size(); requestId++) {
+            if (requests[requestId].write != write) continue;
+            assert(pendingNums[requestId] == 0);
+            latencies.emplace_back(completions[requestId] - requests[requestId].arrival);
+            requestFanOuts.emplace_back(fanOuts[requestId]);
+        }
+        double fanOutSum = 0, maxFanOut = 0;
+        for (auto fanOut : requestFanOuts) {
+            fanOutSum += fanOut;
+            maxFanOut = max(maxFanOut, fanOut);
+        }
+        size_t requestNum = latencies.size();
+        double p50 = percentile(latencies, 0.5), p99 = percentile(latencies, 0.99);
+        cout << (write ? "write" : "read") << "," << requestNum << "," << p50 << "," << p99 << ","
+             << (requestNum > 0 ? fanOutSum / requestNum : 0.0) << "," << percentile(requestFanOuts, 0.99) << ","
+             << maxFanOut << endl;
+    }
+}
@@ -0,0 +1,86 @@
+#ifndef SOCIAL_NETWORK_SIMULATOR_H
+#define SOCIAL_NETWORK_SIMULATOR_H
+
+#include "Trace.h"
+
+#include <vector>
+#include <random>
+#include <cstddef>
+
+using namespace std;
+
+class Manager;
+
+// A discrete event simulation of a request mix against a finished placement. A
+// read of a user's feed goes to the primary server of the user, which reads the
+// copies it holds and asks the primary servers of the friends it has no copy of;
+// a write goes to the primary server of the user and is then applied at every
+// other copy. The servers asked by a request are its fan-out, and it completes
+// when the last of them has answered. Every server is a FIFO queue with a fixed
+// service time per task, and every message between two servers takes a fixed
+// network delay.
+class Simulator {
+public:
+    struct Config {
+        // microseconds a server spends on a task
+        double serviceTime = 50;
+        // microseconds a message between two servers takes
+        double networkDelay = 200;
+        // synthetic requests per second, and the fraction of them which are reads
+        double rate = 10000;
+        double readRatio = 0.9;
+        // seed of the synthetic requests, the one of the placement by default
+        mt19937::result_type seed = mt19937::default_seed;
+    };
+
+private:
+    struct Request {
+        // microseconds since the first request
+        double arrival;
+        bool write;
+        int nodeId;
+    };
+
+    // a request arriving at its primary server, or at a server of its fan-out
+    struct Task {
+        double arrival;
+        size_t sequence;
+        int serverId;
+        int requestId;
+        bool primary;
+
+        // tasks arriving at the same time are served in the order they were sent
+        bool operator>(const Task &other) const {
+            return arrival != other.arrival ? arrival > other.arrival : sequence > other.sequence;
+        }
+    };
+
+    const Manager &manager;
+    Config config;
+    mt19937 generator;
+    vector<Request> requests;
+
+    bool hasCopy(int nodeId, int serverId) const;
+
+public:
+    Simulator(const Manager &manager, const Config &config);
+
+    // requestNum requests of the placed users chosen uniformly, arriving as a
+    // Poisson process at the configured rate
+    void generate(size_t requestNum);
+
+    // the reads and writes of the trace on the placed users, with the timestamps
+    // in microseconds; the other operations are skipped
+    void load(const Trace &trace);
+
+    // simulate the requests and print
+    //   requests,throughput,mean utilization,max utilization
+    //   read,requests,p50,p99,mean fan-out,p99 fan-out,max fan-out
+    //   write,requests,p50,p99,mean fan-out,p99 fan-out,max fan-out
+    // with the throughput in requests per second, the latencies in microseconds,
+    // and the utilization of the servers which served any task
+    void run();
+};
+
+
+#endif //SOCIAL_NETWORK_SIMULATOR_H
@@ -0,0 +1,65 @@
+#include "Trace.h"
+
+#include <fstream>
+#include <sstream>
+#include <iostream>
+
+void Trace::load(const string &fileName) {
+    ifstream fin(fileName);
+    if (!fin) {
+        cerr << "can not read trace file " << fileName << endl;
+        exit(-1);
+    }
+
+    operations.clear();
+    string line;
+    for (size_t lineNum = 1; getline(fin, line); lineNum++) {
+        if (line.empty() || line[0] == '#') continue;
+        istringstream sin(line);
+        Operation operation{0, OperationType::ADD_NODE, -1, -1};
+        char op = 0;
+        if (!(sin >> operation.timestamp >> op >> operation.nodeAId)) {
+            cerr << fileName << ":" << lineNum << ": malformed operation" << endl;
+            exit(-1);
+        }
+        bool twoNodes = false;
+        switch (op) {
+            case 'n':
+                operation.type = OperationType::ADD_NODE;
+                break;
+            case 'e':
+                operation.type = OperationType::ADD_EDGE;
+                twoNodes = true;
+                break;
+            case 'r':
+                operation.type = OperationType::REMOVE_EDGE;
+                twoNodes = true;
+                break;
+            case 'd':
+                operation.type = OperationType::REMOVE_NODE;
+                break;
+            case 'q':
+                operation.type = OperationType::READ;
+                break;
+            case 'w':
+                operation.type = OperationType::WRITE;
+                break;
+            default:
+                cerr << fileName << ":" << lineNum << ": unknown operation " << op << endl;
+                exit(-1);
+        }
+        if (twoNodes && !(sin >> operation.nodeBId)) {
+            cerr << fileName << ":" << lineNum << ": malformed operation" << endl;
+            exit(-1);
+        }
+        if (!operations.empty() && operation.timestamp < operations.back().timestamp) {
+            cerr << fileName << ":" << lineNum << ": timestamp goes back" << endl;
+            exit(-1);
+        }
+        operations.emplace_back(operation);
+    }
+}
+
+const vector<Trace::Operation> &Trace::getOperations() const {
+    return operations;
+}
@@ -0,0 +1,43 @@
+#ifndef SOCIAL_NETWORK_TRACE_H
+#define SOCIAL_NETWORK_TRACE_H
+
+#include <string>
+#include <vector>
+
+using namespace std;
+
+// A timestamped stream of graph operations on raw SNAP ids, one per line as
+//   <timestamp> <op> <node> [<node>]
+// where op is n (add node), e (add edge), r (remove edge), d (remove node),
+// q (read a node and its neighbors) or w (write a node). Lines starting with #
+// are comments, and the timestamps must not decrease.
+class Trace {
+public:
+    enum class OperationType {
+        ADD_NODE,
+        ADD_EDGE,
+        REMOVE_EDGE,
+        REMOVE_NODE,
+        READ,
+        WRITE,
+    };
+
+    struct Operation {
+        long long timestamp;
+        OperationType type;
+        int nodeAId;
+        // -1 for the operations on one node
+        int nodeBId;
+    };
+
+private:
+    vector<Operation> operations;
+
+public:
+    void load(const string &fileName);
+
+    const vector<Operation> &getOperations() const;
+};
+
+
+#endif //SOCIAL_NETWORK_TRACE_H
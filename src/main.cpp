@@ -1,8 +1,10 @@
 #include "Manager.h"
+#include "Simulator.h"
 
 #include <getopt.h>
 #include <iostream>
 #include <algorithm>
+#include <sstream>
 
 using namespace std;
 
@@ -13,10 +15,28 @@ struct Options {
     size_t virtualPrimaryNum = 3;
     int loadConstraint = 1;
     size_t nodeNum = 0;
+    // SPAR scores a batch of this many edges against the same placement, then
+    // applies them one at a time in order, rescoring the stale ones
+    size_t sparBatchSize = 0;
+    string convertFile;
+    string traceFile;
+    long long window = 0;
+    int serverDelta = 0;
+    string capacityFile;
+    bool weighted = false;
+    string attributeFile;
+    size_t simulateNum = 0;
+    // a trace of reads and writes whose timestamps are microseconds
+    string mixFile;
+    Simulator::Config simulator;
+    string failServers;
+    bool verbose = false;
+    // seeds the placement and the synthetic requests of the simulator
+    mt19937::result_type seed = mt19937::default_seed;
 };
 
 Options parseOptions(int argc, char **argv) {
-    const static char *optstring = "d:a:s:k:l:n:";
+    const static char *optstring = "d:a:s:k:l:n:b:c:t:w:r:p:ef:m:g:q:x:u:y:i:vz:";
     const static option long_options[] = {
             {"data",      optional_argument, nullptr, 'd'},
             {"algorithm", optional_argument, nullptr, 'a'},
@@ -24,6 +44,23 @@ Options parseOptions(int argc, char **argv) {
             {"replica",   optional_argument, nullptr, 'k'},
             {"load",      optional_argument, nullptr, 'l'},
             {"node",      optional_argument, nullptr, 'n'},
+            {"batch",     optional_argument, nullptr, 'b'},
+            {"convert",   optional_argument, nullptr, 'c'},
+            {"trace",     optional_argument, nullptr, 't'},
+            {"window",    optional_argument, nullptr, 'w'},
+            {"resize",    optional_argument, nullptr, 'r'},
+            {"capacity",  optional_argument, nullptr, 'p'},
+            {"weighted",  no_argument,       nullptr, 'e'},
+            {"attribute", optional_argument, nullptr, 'f'},
+            {"simulate",  optional_argument, nullptr, 'm'},
+            {"mix",       optional_argument, nullptr, 'g'},
+            {"rate",      optional_argument, nullptr, 'q'},
+            {"reads",     optional_argument, nullptr, 'x'},
+            {"service",   optional_argument, nullptr, 'u'},
+            {"delay",     optional_argument, nullptr, 'y'},
+            {"fail",      optional_argument, nullptr, 'i'},
+            {"verbose",   no_argument,       nullptr, 'v'},
+            {"seed",      optional_argument, nullptr, 'z'},
             {nullptr, 0,                     nullptr, 0}
     };
     int opt, option_index = 0;
@@ -64,6 +101,57 @@ Options parseOptions(int argc, char **argv) {
             case 'n':
                 options.nodeNum = strtoul(optarg, nullptr, 10);
                 break;
+            case 'b':
+                options.sparBatchSize = strtoul(optarg, nullptr, 10);
+                break;
+            case 'c':
+                options.convertFile = optarg;
+                break;
+            case 't':
+                options.traceFile = optarg;
+                break;
+            case 'w':
+                options.window = strtoll(optarg, nullptr, 10);
+                break;
+            case 'r':
+                options.serverDelta = (int) strtol(optarg, nullptr, 10);
+                break;
+            case 'p':
+                options.capacityFile = optarg;
+                break;
+            case 'e':
+                options.weighted = true;
+                break;
+            case 'f':
+                options.attributeFile = optarg;
+                break;
+            case 'm':
+                options.simulateNum = strtoul(optarg, nullptr, 10);
+                break;
+            case 'g':
+                options.mixFile = optarg;
+                break;
+            case 'q':
+                options.simulator.rate = strtod(optarg, nullptr);
+                break;
+            case 'x':
+                options.simulator.readRatio = strtod(optarg, nullptr);
+                break;
+            case 'u':
+                options.simulator.serviceTime = strtod(optarg, nullptr);
+                break;
+            case 'y':
+                options.simulator.networkDelay = strtod(optarg, nullptr);
+                break;
+            case 'i':
+                options.failServers = optarg;
+                break;
+            case 'v':
+                options.verbose = true;
+                break;
+            case 'z':
+                options.seed = strtoul(optarg, nullptr, 10);
+                break;
             default:
                 std::cerr << "Unrecognized option" << std::endl;
                 assert(0);
@@ -75,9 +163,59 @@ Options parseOptions(int argc, char **argv) {
 int main(int argc, char *argv[]) {
     auto options = parseOptions(argc, argv);
 
+    // write the binary snapshot of the data file, which later runs load with -d
+    if (!options.convertFile.empty()) {
+        GraphFile graphFile;
+        graphFile.load(options.dataFile, options.nodeNum, options.weighted);
+        graphFile.saveSnapshot(options.convertFile);
+        return 0;
+    }
+
     Manager manager(options.dataFile, options.algorithm, options.serverNum, options.virtualPrimaryNum,
-                    options.loadConstraint, options.nodeNum);
+                    options.loadConstraint, options.nodeNum, options.sparBatchSize, options.capacityFile,
+                    options.weighted, options.attributeFile, options.seed);
+    manager.setVerbose(options.verbose);
+
+    // replay the operations of the trace on the loaded graph instead of placing all of it
+    if (!options.traceFile.empty()) {
+        Trace trace;
+        trace.load(options.traceFile);
+        manager.replay(trace, options.window);
+        return 0;
+    }
     manager.run();
 
+    // add or remove servers after the placement
+    if (options.serverDelta != 0) {
+        manager.resizeServers(options.serverDelta);
+    }
+
+    // fail every server alone ("all"), or the comma separated servers together
+    if (options.failServers == "all") {
+        manager.failEachServer(options.simulator.serviceTime, options.simulator.networkDelay);
+    } else if (!options.failServers.empty()) {
+        vector<int> serverIds;
+        istringstream sin(options.failServers);
+        string serverId;
+        while (getline(sin, serverId, ',')) {
+            serverIds.emplace_back((int) strtol(serverId.c_str(), nullptr, 10));
+        }
+        manager.failServers(serverIds, options.simulator.serviceTime, options.simulator.networkDelay);
+    }
+
+    // simulate the recorded or a synthetic request mix against the placement
+    if (!options.mixFile.empty() || options.simulateNum > 0) {
+        options.simulator.seed = options.seed;
+        Simulator simulator(manager, options.simulator);
+        if (!options.mixFile.empty()) {
+            Trace trace;
+            trace.load(options.mixFile);
+            simulator.load(trace);
+        } else {
+            simulator.generate(options.simulateNum);
+        }
+        simulator.run();
+    }
+
     return 0;
 }